@@ -0,0 +1,423 @@
+/**
+ * @file    bench_mpool.c
+ * @author  ln
+ * @brief   mpool microbenchmark, every pool mode against glibc malloc
+ *
+ * scenarios:
+ *   single     one thread, alloc a window of blocks then free them
+ *   prodcons   producer allocs, consumer frees on another thread (cross-thread free)
+ *   contend    N threads alloc/free on one shared pool
+ *
+ * ./bench_mpool.out [-s 32,256,4096] [-n ops] [-t threads] [-w window] [-r rate] [-j]
+ *
+ * one result line per (scenario, allocator, size), CSV by default, JSON with -j.
+ * ops counts mallocs + frees. throughput comes from an untimed pass, latency
+ * percentiles from a second pass that times 1 of every <rate> calls.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "mpool.h"
+
+#define BENCH_MAX_SIZES     16
+#define BENCH_RING_SIZE     1024        /* producer/consumer ring, power of 2 */
+
+typedef struct {
+    const char*     name;
+    int             mode;               /* -1: glibc malloc */
+    int             flags;
+    int             cache;              /* per-thread magazine size */
+} bench_alloc_t;
+
+static const bench_alloc_t allocs[] = {
+    { "malloc",             -1,                     0,                      0  },
+    { "mpool-malloc",       MPOOL_MODE_MALLOC,      0,                      0  },
+    { "mpool-istatic",      MPOOL_MODE_ISTATIC,     0,                      0  },
+    { "mpool-istatic-lf",   MPOOL_MODE_ISTATIC,     MPOOL_FLAG_LOCKFREE,    0  },
+    { "mpool-istatic-mag",  MPOOL_MODE_ISTATIC,     0,                      32 },
+    { "mpool-estatic",      MPOOL_MODE_ESTATIC,     0,                      0  },
+    { "mpool-dgrown",       MPOOL_MODE_DGROWN,      0,                      0  },
+};
+
+typedef struct {
+    const bench_alloc_t*    alloc;
+    mpool_t                 pool;
+    char*                   ext_buf;    /* ESTATIC buffer */
+    size_t                  size;
+    size_t                  ops;        /* malloc + free pairs per thread */
+    size_t                  window;
+    int                     rate;       /* 0: untimed pass */
+} bench_t;
+
+typedef struct {
+    bench_t*        bench;
+    uint32_t*       lat;                /* latency samples in ns */
+    size_t          nlat;
+    size_t          cap;
+    void* volatile* ring;
+    volatile size_t* head;
+    volatile size_t* tail;
+} bench_thr_t;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief   create the allocator under test
+ * @param   b       bench
+ *          n       blocks a static pool must hold
+ *
+ * @return  0 is ok, -1 is failed
+ **/
+static int bench_open(bench_t *b, size_t n)
+{
+    const bench_alloc_t *a = b->alloc;
+    int ret = 0;
+
+    b->ext_buf = NULL;
+    if (a->mode < 0)
+        return 0;
+    switch (a->mode) {
+    case MPOOL_MODE_MALLOC:
+        ret = mpool_init(&b->pool, 0, 0);
+        break;
+    case MPOOL_MODE_DGROWN:
+        ret = mpool_init_ex(&b->pool, 0, b->size, a->flags);
+        break;
+    case MPOOL_MODE_ESTATIC: {
+        size_t bs = MPOOL_BUF_SIZE(n, b->size, MPOOL_ALIGN_DEFAULT);
+        if ((b->ext_buf = malloc(bs)) == NULL)
+            return -1;
+        ret = mpool_init_ex(&b->pool, 0, 0, a->flags);
+        if (ret == 0)
+            ret = mpool_setbuf(&b->pool, b->ext_buf, bs, b->size);
+        break;
+    }
+    default:
+        ret = mpool_init_ex(&b->pool, n, b->size, a->flags);
+        break;
+    }
+    if (ret == 0 && a->cache > 0)
+        ret = mpool_set_cache(&b->pool, a->cache);
+    return ret;
+}
+
+static void bench_close(bench_t *b)
+{
+    if (b->alloc->mode >= 0)
+        mpool_destroy(&b->pool);
+    free(b->ext_buf);
+}
+
+static inline void* bench_malloc(bench_t *b)
+{
+    if (b->alloc->mode < 0)
+        return malloc(b->size);
+    return mpool_malloc(&b->pool, b->size);
+}
+
+static inline void bench_free(bench_t *b, void *mem)
+{
+    if (b->alloc->mode < 0)
+        free(mem);
+    else
+        mpool_free(&b->pool, mem);
+}
+
+static inline void lat_add(bench_thr_t *t, uint64_t ns)
+{
+    if (t->nlat < t->cap)
+        t->lat[t->nlat++] = (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t)ns;
+}
+
+/* sampled malloc/free, every rate-th call is timed, none if rate is 0 */
+static inline void* timed_malloc(bench_thr_t *t, size_t i)
+{
+    if (t->bench->rate == 0 || i % t->bench->rate)
+        return bench_malloc(t->bench);
+    uint64_t t0 = now_ns();
+    void *mem = bench_malloc(t->bench);
+    lat_add(t, now_ns() - t0);
+    return mem;
+}
+
+static inline void timed_free(bench_thr_t *t, size_t i, void *mem)
+{
+    if (t->bench->rate == 0 || i % t->bench->rate) {
+        bench_free(t->bench, mem);
+        return;
+    }
+    uint64_t t0 = now_ns();
+    bench_free(t->bench, mem);
+    lat_add(t, now_ns() - t0);
+}
+
+/* alloc a window of blocks, touch them, free them, repeat */
+static void* thr_window(void *arg)
+{
+    bench_thr_t *t = (bench_thr_t *)arg;
+    bench_t *b = t->bench;
+    void **win = malloc(sizeof(void *) * b->window);
+    size_t k = 0;
+
+    for (size_t done = 0; done < b->ops; ) {
+        size_t w = (b->ops - done < b->window) ? b->ops - done : b->window;
+        for (size_t i=0; i<w; i++, k++) {
+            win[i] = timed_malloc(t, k);
+            if (win[i])
+                *(volatile char *)win[i] = 1;
+        }
+        for (size_t i=0; i<w; i++, k++) {
+            if (win[i])
+                timed_free(t, k, win[i]);
+        }
+        done += w;
+    }
+    free(win);
+    return NULL;
+}
+
+static void* thr_producer(void *arg)
+{
+    bench_thr_t *t = (bench_thr_t *)arg;
+    bench_t *b = t->bench;
+
+    for (size_t i=0; i<b->ops; i++) {
+        void *mem;
+        while ((mem = timed_malloc(t, i)) == NULL)
+            sched_yield();
+        while (*t->head - __atomic_load_n(t->tail, __ATOMIC_ACQUIRE) >= BENCH_RING_SIZE)
+            sched_yield();
+        t->ring[*t->head & (BENCH_RING_SIZE-1)] = mem;
+        __atomic_store_n(t->head, *t->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void* thr_consumer(void *arg)
+{
+    bench_thr_t *t = (bench_thr_t *)arg;
+    bench_t *b = t->bench;
+
+    for (size_t i=0; i<b->ops; i++) {
+        while (__atomic_load_n(t->head, __ATOMIC_ACQUIRE) == *t->tail)
+            sched_yield();
+        void *mem = t->ring[*t->tail & (BENCH_RING_SIZE-1)];
+        __atomic_store_n(t->tail, *t->tail + 1, __ATOMIC_RELEASE);
+        timed_free(t, i, mem);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t pct(const uint32_t *lat, size_t n, double p)
+{
+    if (n == 0)
+        return 0;
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return lat[i];
+}
+
+/**
+ * @brief   run the threads of one scenario on a fresh allocator
+ * @param   scenario    "single", "prodcons" or "contend"
+ *          b           bench, allocator, size & rate are set
+ *          nthr        number of threads
+ *          lat_out     output, latency samples sorted, free it
+ *          nlat_out    output, number of samples, 0 if b->rate is 0
+ *
+ * @return  wall time in ns, 0 is failed
+ **/
+static uint64_t bench_pass(const char *scenario, bench_t *b, int nthr, uint32_t **lat_out, size_t *nlat_out)
+{
+    int prodcons = (strcmp(scenario, "prodcons") == 0);
+    size_t need = prodcons ? BENCH_RING_SIZE + 2 : b->window * (size_t)nthr;
+    need += (size_t)b->alloc->cache * 2 * (size_t)nthr;     /* blocks parked in magazines */
+    bench_thr_t thr[nthr];
+    pthread_t tid[nthr];
+    void * volatile ring[BENCH_RING_SIZE];
+    volatile size_t head = 0, tail = 0;
+
+    *lat_out = NULL;
+    *nlat_out = 0;
+    if (bench_open(b, need) != 0) {
+        fprintf(stderr, "%s: open %s failed\n", scenario, b->alloc->name);
+        return 0;
+    }
+
+    size_t cap = b->rate ? (b->ops * 2) / (size_t)b->rate + 2 : 0;
+    for (int i=0; i<nthr; i++) {
+        thr[i].bench = b;
+        thr[i].lat = cap ? malloc(sizeof(uint32_t) * cap) : NULL;
+        thr[i].nlat = 0;
+        thr[i].cap = cap;
+        thr[i].ring = ring;
+        thr[i].head = &head;
+        thr[i].tail = &tail;
+    }
+
+    uint64_t t0 = now_ns();
+    for (int i=0; i<nthr; i++) {
+        void* (*fn)(void *) = prodcons ? ((i == 0) ? thr_producer : thr_consumer) : thr_window;
+        pthread_create(&tid[i], NULL, fn, &thr[i]);
+    }
+    for (int i=0; i<nthr; i++)
+        pthread_join(tid[i], NULL);
+    uint64_t ns = now_ns() - t0;
+
+    size_t nlat = 0;
+    for (int i=0; i<nthr; i++)
+        nlat += thr[i].nlat;
+    uint32_t *lat = malloc(sizeof(uint32_t) * (nlat + 1));
+    nlat = 0;
+    for (int i=0; i<nthr; i++) {
+        if (thr[i].nlat)
+            memcpy(lat + nlat, thr[i].lat, sizeof(uint32_t) * thr[i].nlat);
+        nlat += thr[i].nlat;
+        free(thr[i].lat);
+    }
+    qsort(lat, nlat, sizeof(uint32_t), cmp_u32);
+
+    bench_close(b);
+    *lat_out = lat;
+    *nlat_out = nlat;
+    return (ns > 0) ? ns : 1;
+}
+
+/**
+ * @brief   run one scenario and print its result line
+ * @param   scenario    "single", "prodcons" or "contend"
+ *          b           bench, allocator & size are set
+ *          nthr        number of threads
+ *          rate        latency pass times 1 of every <rate> calls
+ *          json        JSON output
+ *          first       first JSON record
+ *
+ * @return  0 is ok, -1 is failed
+ **/
+static int bench_run(const char *scenario, bench_t *b, int nthr, int rate, int json, int first)
+{
+    int prodcons = (strcmp(scenario, "prodcons") == 0);
+    uint32_t *lat;
+    size_t nlat;
+
+    /* throughput pass, no clock read inside the loop */
+    b->rate = 0;
+    uint64_t ns = bench_pass(scenario, b, nthr, &lat, &nlat);
+    free(lat);
+    if (ns == 0)
+        return -1;
+
+    /* latency pass, sparse samples */
+    b->rate = rate;
+    if (bench_pass(scenario, b, nthr, &lat, &nlat) == 0)
+        return -1;
+
+    /* prodcons: one malloc + one free per op across both threads */
+    size_t ops = prodcons ? b->ops * 2 : b->ops * 2 * (size_t)nthr;
+    double secs = (double)ns / 1e9;
+    double ops_sec = (double)ops / secs;
+    uint32_t p50 = pct(lat, nlat, 0.50), p99 = pct(lat, nlat, 0.99), p999 = pct(lat, nlat, 0.999);
+
+    if (json) {
+        printf("%s  {\"scenario\": \"%s\", \"allocator\": \"%s\", \"size\": %zu, \"threads\": %d, "
+               "\"ops\": %zu, \"secs\": %.6f, \"ops_per_sec\": %.0f, \"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u}",
+               first ? "" : ",\n", scenario, b->alloc->name, b->size, nthr, ops, secs, ops_sec, p50, p99, p999);
+    } else {
+        printf("%s,%s,%zu,%d,%zu,%.6f,%.0f,%u,%u,%u\n",
+               scenario, b->alloc->name, b->size, nthr, ops, secs, ops_sec, p50, p99, p999);
+    }
+    fflush(stdout);
+
+    free(lat);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s sizes] [-n ops] [-t threads] [-w window] [-r rate] [-j]\n"
+                    "  -s   comma separated block sizes, default 32,256,4096\n"
+                    "  -n   malloc/free pairs per thread, default 1000000\n"
+                    "  -t   threads of the contend scenario, default number of cpus\n"
+                    "  -w   blocks held at once per thread, default 64\n"
+                    "  -r   latency pass times 1 of every <rate> calls, default 64\n"
+                    "  -j   JSON output, default CSV\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    size_t sizes[BENCH_MAX_SIZES] = {32, 256, 4096};
+    int nsize = 3;
+    size_t ops = 1000000;
+    size_t window = 64;
+    int nthr = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int rate = 64;
+    int json = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:n:t:w:r:jh")) != -1) {
+        switch (opt) {
+        case 's':
+            nsize = 0;
+            for (char *s = strtok(optarg, ","); s && nsize < BENCH_MAX_SIZES; s = strtok(NULL, ","))
+                sizes[nsize++] = strtoul(s, NULL, 0);
+            break;
+        case 'n': ops = strtoul(optarg, NULL, 0); break;
+        case 't': nthr = atoi(optarg); break;
+        case 'w': window = strtoul(optarg, NULL, 0); break;
+        case 'r': rate = atoi(optarg); break;
+        case 'j': json = 1; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (nthr < 2)
+        nthr = 2;
+    if (rate < 1)
+        rate = 1;
+    if (window < 1)
+        window = 1;
+
+    static const char *scenarios[] = { "single", "prodcons", "contend" };
+    int first = 1;
+
+    if (json)
+        printf("[\n");
+    else
+        printf("scenario,allocator,size,threads,ops,secs,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+
+    for (int s=0; s<3; s++) {
+        int threads = (s == 0) ? 1 : (s == 1) ? 2 : nthr;
+        for (size_t a=0; a<sizeof(allocs)/sizeof(allocs[0]); a++) {
+            for (int z=0; z<nsize; z++) {
+                bench_t b;
+                b.alloc = &allocs[a];
+                b.size = sizes[z];
+                b.ops = ops;
+                b.window = window;
+                if (bench_run(scenarios[s], &b, threads, rate, json, first) == 0)
+                    first = 0;
+            }
+        }
+    }
+
+    if (json)
+        printf("\n]\n");
+    return 0;
+}
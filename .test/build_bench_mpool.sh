@@ -0,0 +1,4 @@
+gcc -O2 -Wall -o bench_mpool.out bench_mpool.c -I../utils -L../utils -lutils -lpthread -lm
+
+# ./bench_mpool.out -s 32,256,4096 -n 1000000 -t 4 > bench.csv
+# ./bench_mpool.out -j -r 16 > bench.json
@@ -0,0 +1 @@
+gcc -o shmpool.out test_shmpool.c -I../utils -L../utils -lutils -lrt
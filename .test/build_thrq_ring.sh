@@ -0,0 +1 @@
+gcc -o thrq_ring.out test_thrq_ring.c -I../utils -L../utils -lutils -lpthread -lm
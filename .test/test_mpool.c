@@ -1,10 +1,289 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
 #include "mpool.h"
 
+#define LF_BLOCKS       64
+#define LF_SIZE         64
+#define LF_THREADS      4
+#define LF_ROUNDS       20000
+#define CA_MAG          8       /* magazine size of cache test, pool is LF_BLOCKS x LF_SIZE */
+#define CH_BLOCKS       16      /* blocks per DGROWN chunk of trim test */
+
+static void check(int ok, const char *what)
+{
+    if (ok) {
+        printf("%s: ok\n", what);
+    } else {
+        printf("%s: error\n", what);
+        exit(1);
+    }
+}
+
+/* every block is stamped by its owner, a block handed out twice gets a foreign stamp */
+void* lf_worker(void *arg)
+{
+    mpool_t *mp = (mpool_t *)arg;
+    long id = (long)pthread_self();
+    long bad = 0;
+    void *p[8];
+
+    for (int r=0; r<LF_ROUNDS; r++) {
+        int k = 1 + r % 8, got;
+        if (r % 2) {
+            got = mpool_malloc_n(mp, LF_SIZE, p, k);
+        } else {
+            for (got=0; got<k && (p[got] = mpool_malloc(mp, LF_SIZE)) != NULL; got++)
+                ;
+        }
+        for (int i=0; i<got; i++) {
+            for (int j=0; j<LF_SIZE/(int)sizeof(long); j++)
+                ((long *)p[i])[j] = id ^ j;
+        }
+        sched_yield();
+        for (int i=0; i<got; i++) {
+            for (int j=0; j<LF_SIZE/(int)sizeof(long); j++)
+                bad += (((long *)p[i])[j] != (id ^ j));
+        }
+        if (r % 2) {
+            mpool_free_n(mp, p, got);
+        } else {
+            for (int i=0; i<got; i++)
+                mpool_free(mp, p[i]);
+        }
+    }
+    return (void *)bad;
+}
+
+/* all blocks can be taken once, no more, each one distinct */
+static int lf_drain(mpool_t *mp)
+{
+    char *p[LF_BLOCKS];
+    int ok = 1;
+
+    for (int i=0; i<LF_BLOCKS; i++) {
+        if ((p[i] = (char *)mpool_malloc(mp, LF_SIZE)) == NULL)
+            ok = 0;
+        for (int j=0; ok && j<i; j++)
+            ok = (p[j] != p[i]);
+    }
+    if (ok && mpool_malloc(mp, LF_SIZE) != NULL)
+        ok = 0;
+    for (int i=0; i<LF_BLOCKS; i++)
+        mpool_free(mp, p[i]);
+    return ok;
+}
+
+static void lockfree_test(void)
+{
+    static char ext[MPOOL_BUF_SIZE(LF_BLOCKS, LF_SIZE, MPOOL_ALIGN_DEFAULT)];
+    mpool_t mp;
+
+    for (int estatic=0; estatic<2; estatic++) {
+        const int flags = MPOOL_FLAG_LOCKFREE | MPOOL_FLAG_STATS;
+        if (estatic) {
+            check(mpool_init_ex(&mp, 0, 0, flags) == 0 && mpool_setbuf(&mp, ext, sizeof(ext), LF_SIZE) == 0 &&
+                  mp.n == LF_BLOCKS, "lock-free estatic init");
+        } else {
+            check(mpool_init_ex(&mp, LF_BLOCKS, LF_SIZE, flags) == 0, "lock-free istatic init");
+        }
+        check(lf_drain(&mp), "lock-free drain before threads");
+
+        pthread_t tid[LF_THREADS];
+        long bad = 0;
+        for (int i=0; i<LF_THREADS; i++)
+            pthread_create(&tid[i], NULL, lf_worker, &mp);
+        for (int i=0; i<LF_THREADS; i++) {
+            void *ret;
+            pthread_join(tid[i], &ret);
+            bad += (long)ret;
+        }
+        check(bad == 0, "lock-free no block handed out twice");
+
+        mpool_stats_t st;
+        mpool_stats(&mp, &st);
+        check(st.in_use == 0 && st.allocs == st.frees && st.allocs > 0 && st.high_water <= LF_BLOCKS,
+              "lock-free stats balanced");
+        check(lf_drain(&mp), "lock-free drain after threads");
+        mpool_destroy(&mp);
+    }
+}
+
+static void* ca_blocks[LF_BLOCKS/2];
+
+/* take half of the pool & exit holding it, the rest of the magazine goes back on exit */
+void* ca_alloc(void *arg)
+{
+    mpool_t *mp = (mpool_t *)arg;
+    long got = 0;
+
+    for (int i=0; i<LF_BLOCKS/2; i++) {
+        if ((ca_blocks[i] = mpool_malloc(mp, LF_SIZE)) != NULL)
+            got++;
+    }
+    return (void *)got;
+}
+
+/* free blocks allocated by another thread */
+void* ca_free(void *arg)
+{
+    mpool_t *mp = (mpool_t *)arg;
+
+    for (int i=0; i<LF_BLOCKS/2; i++)
+        mpool_free(mp, ca_blocks[i]);
+    return NULL;
+}
+
+/* number of blocks a new thread can take, they go back when it exits */
+void* ca_drain(void *arg)
+{
+    mpool_t *mp = (mpool_t *)arg;
+    void *p[LF_BLOCKS + 1];
+    long got = 0;
+
+    while (got < LF_BLOCKS + 1 && (p[got] = mpool_malloc(mp, LF_SIZE)) != NULL)
+        got++;
+    for (long i=0; i<got; i++)
+        mpool_free(mp, p[i]);
+    return (void *)got;
+}
+
+static long ca_run(mpool_t *mp, void *(*fn)(void *))
+{
+    pthread_t tid;
+    void *ret;
+
+    pthread_create(&tid, NULL, fn, mp);
+    pthread_join(tid, &ret);
+    return (long)ret;
+}
+
+static void cache_test(void)
+{
+    mpool_t mp;
+    mpool_stats_t st;
+    uint64_t hits, misses;
+    void *p[4];
+
+    check(mpool_init(&mp, LF_BLOCKS, LF_SIZE) == 0 && mpool_set_cache(&mp, CA_MAG) == 0, "cache init");
+
+    check(ca_run(&mp, ca_alloc) == LF_BLOCKS/2, "cache alloc in thread");
+    mpool_cache_stats(&mp, &hits, &misses);
+    check(hits + misses == LF_BLOCKS/2 && misses > 0 && hits > misses, "cache hits & misses counted");
+    mpool_stats(&mp, &st);
+    check(st.in_use == LF_BLOCKS/2 && st.allocs == LF_BLOCKS/2, "cache in_use of exited thread");
+
+    ca_run(&mp, ca_free);
+    mpool_stats(&mp, &st);
+    check(st.in_use == 0 && st.frees == LF_BLOCKS/2, "cache free on other thread");
+    check(ca_run(&mp, ca_drain) == LF_BLOCKS, "cache blocks of exited threads back in pool");
+
+    /* blocks freed by main stay in its magazine until flushed */
+    for (int i=0; i<4; i++)
+        p[i] = mpool_malloc(&mp, LF_SIZE);
+    for (int i=0; i<4; i++)
+        mpool_free(&mp, p[i]);
+    check(ca_run(&mp, ca_drain) < LF_BLOCKS, "cache keeps blocks of live thread");
+    mpool_cache_flush(&mp);
+    check(ca_run(&mp, ca_drain) == LF_BLOCKS, "cache flush returns blocks");
+
+    pthread_t tid[LF_THREADS];
+    long bad = 0;
+    for (int i=0; i<LF_THREADS; i++)
+        pthread_create(&tid[i], NULL, lf_worker, &mp);
+    for (int i=0; i<LF_THREADS; i++) {
+        void *ret;
+        pthread_join(tid[i], &ret);
+        bad += (long)ret;
+    }
+    check(bad == 0, "cache no block handed out twice");
+    mpool_stats(&mp, &st);
+    check(st.in_use == 0 && st.allocs == st.frees, "cache stats balanced");
+    check(ca_run(&mp, ca_drain) == LF_BLOCKS, "cache drain after threads");
+    mpool_destroy(&mp);
+}
+
+/* capacity & grows of the pool stats */
+static int ch_stats(mpool_t *mp, size_t capacity, uint64_t grows, size_t in_use)
+{
+    mpool_stats_t st;
+    return mpool_stats(mp, &st) == 0 && st.capacity == capacity && st.grows == grows && st.in_use == in_use;
+}
+
+static void chunk_test(void)
+{
+    mpool_t mp;
+    char *p[LF_BLOCKS];
+    int ok = 1;
+
+    check(mpool_init_ex(&mp, 0, LF_SIZE, MPOOL_FLAG_STATS) == 0 && mpool_set_chunk(&mp, CH_BLOCKS) == 0, "chunk init");
+    for (int i=0; i<LF_BLOCKS; i++) {
+        if ((p[i] = (char *)mpool_malloc(&mp, LF_SIZE)) == NULL)
+            ok = 0;
+        else
+            memset(p[i], i, LF_SIZE);
+    }
+    check(ok && ch_stats(&mp, LF_BLOCKS, LF_BLOCKS/CH_BLOCKS, LF_BLOCKS), "chunk grows");
+
+    /* the pool was empty at every grow, first & last block are of the first & last chunk */
+    for (int i=1; i<LF_BLOCKS-1; i++)
+        mpool_free(&mp, p[i]);
+    check(mpool_trim(&mp) == LF_BLOCKS/CH_BLOCKS - 2 && ch_stats(&mp, 2*CH_BLOCKS, LF_BLOCKS/CH_BLOCKS, 2),
+          "chunk trim keeps chunks in use");
+    check(p[0][0] == 0 && p[0][LF_SIZE-1] == 0 && p[LF_BLOCKS-1][0] == LF_BLOCKS-1, "chunk blocks in use intact");
+
+    /* free blocks of the kept chunks are still in the pool */
+    for (int i=1; i<2*CH_BLOCKS-1; i++) {
+        if ((p[i] = (char *)mpool_malloc(&mp, LF_SIZE)) == NULL)
+            ok = 0;
+    }
+    check(ok && ch_stats(&mp, 2*CH_BLOCKS, LF_BLOCKS/CH_BLOCKS, 2*CH_BLOCKS), "chunk kept blocks reused");
+    for (int i=1; i<2*CH_BLOCKS-1; i++)
+        mpool_free(&mp, p[i]);
+
+    mpool_free(&mp, p[LF_BLOCKS-1]);
+    check(mpool_trim(&mp) == 1 && ch_stats(&mp, CH_BLOCKS, LF_BLOCKS/CH_BLOCKS, 1), "chunk trim after free");
+    mpool_free(&mp, p[0]);
+    check(mpool_trim(&mp) == 1 && ch_stats(&mp, 0, LF_BLOCKS/CH_BLOCKS, 0), "chunk trim all");
+    check(mpool_trim(&mp) == 0, "chunk trim nothing");
+
+    /* new chunk size applies to the next grow */
+    mpool_set_chunk(&mp, CH_BLOCKS/2);
+    p[0] = (char *)mpool_malloc(&mp, LF_SIZE);
+    check(p[0] && ch_stats(&mp, CH_BLOCKS/2, LF_BLOCKS/CH_BLOCKS + 1, 1), "chunk set_chunk on next grow");
+    mpool_free(&mp, p[0]);
+    mpool_destroy(&mp);
+}
+
+/* MPOOL_BUF_SIZE holds n blocks wherever the buffer starts */
+static void setbuf_test(void)
+{
+    static char buf[MPOOL_BUF_SIZE(LF_BLOCKS, LF_SIZE, MPOOL_ALIGN_CACHELINE) + MPOOL_ALIGN_CACHELINE];
+    static const int flags[] = { 0, MPOOL_FLAG_ALIGN64 };
+    static const size_t align[] = { MPOOL_ALIGN_DEFAULT, MPOOL_ALIGN_CACHELINE };
+    mpool_t mp;
+    int ok = 1;
+
+    for (int i=0; i<2; i++) {
+        for (size_t off=0; off<align[i]; off++) {
+            ok = ok && mpool_init_ex(&mp, 0, 0, flags[i]) == 0 &&
+                 mpool_setbuf(&mp, buf + off, MPOOL_BUF_SIZE(LF_BLOCKS, LF_SIZE, align[i]), LF_SIZE) == 0 &&
+                 mp.n == LF_BLOCKS && ((size_t)mpool_malloc(&mp, LF_SIZE) % align[i]) == 0;
+            mpool_destroy(&mp);
+        }
+    }
+    check(ok, "setbuf n blocks of MPOOL_BUF_SIZE at any offset");
+}
+
 int main(void)
 {
+    setbuf_test();
+    lockfree_test();
+    cache_test();
+    chunk_test();
+
     mpool_t *mp = mpool_new(0, 0);
     int count = 0;
     int num = 0;
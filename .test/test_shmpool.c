@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include "shmpool.h"
+
+#define NBLOCKS     16
+#define DATA_SIZE   100
+#define ROUNDS      20000
+
+static void check(int ok, const char *what)
+{
+    if (ok) {
+        printf("%s: ok\n", what);
+    } else {
+        printf("%s: error\n", what);
+        exit(1);
+    }
+}
+
+/* all blocks can be taken once, no more, each one distinct */
+static int drain(shmpool_t *pool)
+{
+    void *p[NBLOCKS];
+    int ok = 1;
+
+    for (int i=0; i<NBLOCKS; i++) {
+        if ((p[i] = shmpool_malloc(pool, DATA_SIZE)) == NULL)
+            ok = 0;
+        for (int j=0; ok && j<i; j++)
+            ok = (p[j] != p[i]);
+    }
+    if (ok && (shmpool_malloc(pool, DATA_SIZE) != NULL || errno != ENOMEM))
+        ok = 0;
+    for (int i=0; i<NBLOCKS; i++)
+        shmpool_free(pool, p[i]);
+    return ok;
+}
+
+/* alloc, stamp, check & free, a block handed out twice gets a foreign stamp */
+static long stress(shmpool_t *pool)
+{
+    const long id = (long)getpid();
+    long bad = 0;
+    long *p[4];
+
+    for (int r=0; r<ROUNDS; r++) {
+        int got = 0;
+        while (got < 4 && (p[got] = (long *)shmpool_malloc(pool, DATA_SIZE)) != NULL)
+            got++;
+        for (int i=0; i<got; i++)
+            p[i][0] = p[i][1] = id + r;
+        if (r % 64 == 0)
+            sched_yield();
+        for (int i=0; i<got; i++) {
+            bad += (p[i][0] != id + r || p[i][1] != id + r);
+            shmpool_free(pool, p[i]);
+        }
+    }
+    return bad;
+}
+
+/* attach by name, free the parent's blocks, hand half of the pool back by offset */
+static int child(const char *name, int rfd, int wfd, const char *parent_base)
+{
+    shmpool_t *pool = shmpool_attach(name);
+    uint64_t off[NBLOCKS];
+    char *p[NBLOCKS];
+    char expect[DATA_SIZE];
+
+    if (pool == NULL || pool->base == parent_base)
+        return 1;
+    if (read(rfd, off, 4*sizeof(uint64_t)) != 4*sizeof(uint64_t))
+        return 2;
+    for (int i=0; i<4; i++) {
+        char *mem = (char *)shmpool_ptr(pool, off[i]);
+        snprintf(expect, sizeof(expect), "parent %d", i);
+        if (mem == NULL || strcmp(mem, expect) != 0)
+            return 3;
+        shmpool_free(pool, mem);
+    }
+    if (!drain(pool))
+        return 4;
+
+    for (int i=0; i<NBLOCKS; i++) {
+        if ((p[i] = (char *)shmpool_malloc(pool, DATA_SIZE)) == NULL)
+            return 5;
+        snprintf(p[i], DATA_SIZE, "child %d", i);
+        off[i] = shmpool_offset(pool, p[i]);
+    }
+    for (int i=NBLOCKS/2; i<NBLOCKS; i++)
+        shmpool_free(pool, p[i]);
+    if (write(wfd, off, NBLOCKS/2*sizeof(uint64_t)) != NBLOCKS/2*sizeof(uint64_t))
+        return 6;
+
+    long bad = stress(pool);
+    shmpool_detach(pool);
+    return bad ? 7 : 0;
+}
+
+int main(void)
+{
+    char name[64];
+    int down[2], up[2];
+    uint64_t off[NBLOCKS];
+    char expect[DATA_SIZE];
+
+    snprintf(name, sizeof(name), "/test_shmpool_%d", (int)getpid());
+    shmpool_unlink(name);
+
+    shmpool_t *pool = shmpool_create(name, NBLOCKS, DATA_SIZE);
+    check(pool != NULL && pool->hdr->n == NBLOCKS && pool->hdr->attached == 1, "create");
+    check(shmpool_create(name, NBLOCKS, DATA_SIZE) == NULL && errno == EEXIST, "create EEXIST on used name");
+    check(shmpool_malloc(pool, DATA_SIZE + 1) == NULL && errno == ENOMEM, "malloc over data_size");
+    check(drain(pool), "drain in creator");
+
+    for (int i=0; i<4; i++) {
+        char *mem = (char *)shmpool_malloc(pool, DATA_SIZE);
+        snprintf(mem, DATA_SIZE, "parent %d", i);
+        off[i] = shmpool_offset(pool, mem);
+    }
+    check(shmpool_ptr(pool, 0) == NULL && shmpool_ptr(pool, pool->map_size) == NULL, "ptr of offset out of pool");
+
+    if (pipe(down) != 0 || pipe(up) != 0)
+        return 1;
+    pid_t pid = fork();
+    if (pid == 0)
+        _exit(child(name, down[0], up[1], pool->base));
+    check(pid > 0, "fork");
+    check(write(down[1], off, 4*sizeof(uint64_t)) == 4*sizeof(uint64_t), "send offsets to child");
+
+    /* half of the pool is held by the child, the other half was freed there */
+    int ok = (read(up[0], off, NBLOCKS/2*sizeof(uint64_t)) == NBLOCKS/2*sizeof(uint64_t));
+    for (int i=0; ok && i<NBLOCKS/2; i++) {
+        char *mem = (char *)shmpool_ptr(pool, off[i]);
+        snprintf(expect, sizeof(expect), "child %d", i);
+        ok = (mem != NULL && strcmp(mem, expect) == 0);
+        if (ok)
+            shmpool_free(pool, mem);
+    }
+    check(ok, "free blocks of child by offset");
+
+    long bad = stress(pool);
+    int status;
+    waitpid(pid, &status, 0);
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "child attach, free & alloc");
+    check(bad == 0, "no block handed out twice between processes");
+    check(pool->hdr->attached == 1, "child detached");
+    check(drain(pool), "drain after child");
+
+    /* the name is gone after unlink, the mapping stays until detach */
+    check(shmpool_unlink(name) == 0, "unlink");
+    check(shmpool_attach(name) == NULL && errno == ENOENT, "attach after unlink");
+    check(drain(pool), "pool usable after unlink");
+    check(shmpool_detach(pool) == 0, "detach");
+
+    pool = shmpool_create(name, NBLOCKS, DATA_SIZE);
+    check(pool != NULL, "create again after unlink");
+    shmpool_unlink(name);
+    shmpool_detach(pool);
+    return 0;
+}
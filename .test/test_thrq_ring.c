@@ -0,0 +1,776 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include "thrq.h"
+
+#define NMSG        20000       /* messages per producer */
+#define NTHR        4           /* producers & consumers of list/MPMC */
+#define BATCH       8
+
+typedef struct {
+    int     prod;
+    int     seq;
+} msg_t;
+
+typedef struct __worker worker_t;
+
+/* how producers send & consumers receive */
+typedef struct {
+    const char* name;
+    int         (*send)(worker_t *w, int seq);      /* messages sent from seq, <= 0 to retry */
+    int         (*recv)(worker_t *w, int *last);    /* messages received, <= 0 & errno on timeout */
+} run_t;
+
+struct __worker {
+    thrq_cb_t*      q;
+    int             id;
+    const run_t*    run;
+    int             total;      /* messages all consumers expect */
+    int*            received;   /* shared counter of consumers */
+    long long       sum;
+    int             error;
+};
+
+static void check(int ok, const char *what)
+{
+    if (ok) {
+        printf("%s: ok\n", what);
+    } else {
+        printf("%s: error\n", what);
+        exit(1);
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* every producer's messages must come in order, sum of seq is the checksum */
+static void consume(worker_t *w, const msg_t *m, int *last)
+{
+    if (m->prod < 0 || m->prod >= NTHR || m->seq <= last[m->prod])
+        w->error = 1;
+    else
+        last[m->prod] = m->seq;
+    w->sum += m->seq;
+}
+
+static int send_copy(worker_t *w, int seq)
+{
+    msg_t m = { w->id, seq };
+    return (thrq_send(w->q, &m, sizeof(m)) == 0) ? 1 : 0;
+}
+
+static int recv_copy(worker_t *w, int *last)
+{
+    msg_t m;
+    if (thrq_receive(w->q, &m, sizeof(m), 0.05) != sizeof(m))
+        return 0;
+    consume(w, &m, last);
+    return 1;
+}
+
+static int recv_batch(worker_t *w, int *last)
+{
+    msg_t m[BATCH];
+    struct iovec iov[BATCH];
+
+    for (int i=0; i<BATCH; i++) {
+        iov[i].iov_base = &m[i];
+        iov[i].iov_len = sizeof(msg_t);
+    }
+    int k = thrq_receive_n(w->q, iov, BATCH, 0.05);
+    for (int i=0; i<k; i++) {
+        if (iov[i].iov_len != sizeof(msg_t))
+            w->error = 1;
+        consume(w, &m[i], last);
+    }
+    return k;
+}
+
+static int send_batch(worker_t *w, int seq)
+{
+    msg_t m[BATCH];
+    struct iovec iov[BATCH];
+    int k = (NMSG - seq < BATCH) ? NMSG - seq : BATCH;
+
+    for (int i=0; i<k; i++) {
+        m[i].prod = w->id;
+        m[i].seq = seq + i;
+        iov[i].iov_base = &m[i];
+        iov[i].iov_len = sizeof(msg_t);
+    }
+    return thrq_send_n(w->q, iov, k, THRQ_SEND_PARTIAL);
+}
+
+static int send_zc(worker_t *w, int seq)
+{
+    msg_t *p = (msg_t *)thrq_reserve(w->q, sizeof(msg_t));
+    if (p == NULL)
+        return 0;
+    p->prod = w->id;
+    p->seq = seq;
+    while (thrq_commit(w->q, p, sizeof(msg_t)) != 0)
+        sched_yield();
+    return 1;
+}
+
+static int recv_zc(worker_t *w, int *last)
+{
+    int len;
+    const msg_t *p = (const msg_t *)thrq_peek(w->q, &len, 0.05);
+    if (p == NULL)
+        return 0;
+    if (len != sizeof(msg_t))
+        w->error = 1;
+    consume(w, p, last);
+    thrq_release(w->q, p);
+    return 1;
+}
+
+static const run_t run_copy = { "send/receive", send_copy, recv_copy };
+static const run_t run_recv_n = { "send/receive_n", send_copy, recv_batch };
+static const run_t run_send_n = { "send_n/receive", send_batch, recv_copy };
+static const run_t run_zc = { "reserve/commit/peek/release", send_zc, recv_zc };
+
+void* producer(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+
+    for (int seq = 0; seq < NMSG; ) {
+        int r = w->run->send(w, seq);
+        if (r > 0)
+            seq += r;
+        else
+            sched_yield();
+    }
+    return NULL;
+}
+
+void* consumer(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    int last[NTHR];
+
+    for (int i=0; i<NTHR; i++)
+        last[i] = -1;
+
+    while (__atomic_load_n(w->received, __ATOMIC_RELAXED) < w->total) {
+        int k = w->run->recv(w, last);
+        if (k > 0)
+            __atomic_add_fetch(w->received, k, __ATOMIC_RELAXED);
+        else if (errno != ETIMEDOUT)
+            w->error = 1;
+    }
+    return NULL;
+}
+
+/* producers & consumers on one queue, 1x1 for SPSC, checksum & per producer order */
+static void run_checksum(int mode, int wait, const run_t *run)
+{
+    static const char *modes[] = { "list", "spsc", "mpmc" };
+    const int nthr = (mode == THRQ_MODE_SPSC) ? 1 : NTHR;
+    thrq_cb_t q;
+    worker_t prod[NTHR], cons[NTHR];
+    pthread_t tp[NTHR], tc[NTHR];
+    int received = 0;
+    char what[128];
+
+    thrq_init(&q);
+    if (mode != THRQ_MODE_LIST)
+        thrq_set_ring(&q, mode, 256, sizeof(msg_t));
+    else
+        thrq_set_maxsize(&q, 256);
+    thrq_set_wait(&q, wait, -1);
+
+    for (int i=0; i<nthr; i++) {
+        memset(&prod[i], 0, sizeof(worker_t));
+        prod[i].q = &q;
+        prod[i].id = i;
+        prod[i].run = run;
+        cons[i] = prod[i];
+        cons[i].total = nthr * NMSG;
+        cons[i].received = &received;
+        pthread_create(&tc[i], NULL, consumer, &cons[i]);
+    }
+    for (int i=0; i<nthr; i++)
+        pthread_create(&tp[i], NULL, producer, &prod[i]);
+
+    long long sum = 0;
+    int error = 0;
+    for (int i=0; i<nthr; i++) {
+        pthread_join(tp[i], NULL);
+        pthread_join(tc[i], NULL);
+        sum += cons[i].sum;
+        error |= cons[i].error;
+    }
+
+    long long expect = (long long)nthr * NMSG * (NMSG - 1) / 2;
+    snprintf(what, sizeof(what), "%s %s %dx%d %s", modes[mode], run->name, nthr, nthr,
+             (wait == THRQ_WAIT_SPIN) ? "spin" : "cond");
+    check(!error && sum == expect && received == nthr * NMSG && thrq_empty(&q), what);
+    thrq_destroy(&q);
+}
+
+/* call returned -1 with ETIMEDOUT, after about the timeout */
+static void check_timeout(int failed, double t0, double timeout, const char *what)
+{
+    double dt = now() - t0;
+    check(failed && errno == ETIMEDOUT && dt >= timeout * 0.9 && dt < timeout + 1.0, what);
+}
+
+static void test_spsc(void)
+{
+    thrq_cb_t q;
+    int v = 0;
+    double t0;
+
+    run_checksum(THRQ_MODE_SPSC, THRQ_WAIT_COND, &run_copy);
+
+    thrq_init(&q);
+    check(thrq_set_ring(&q, THRQ_MODE_SPSC, 4, sizeof(v)) == 0, "spsc set_ring");
+    t0 = now();
+    check_timeout(thrq_receive(&q, &v, sizeof(v), 0.1) < 0, t0, 0.1, "spsc receive timeout on empty queue");
+    for (int i=0; i<4; i++)
+        thrq_send(&q, &i, sizeof(i));
+    check(thrq_send(&q, &v, sizeof(v)) < 0 && errno == EAGAIN && thrq_count(&q) == 4, "spsc send EAGAIN when full");
+    for (int i=0; i<4; i++) {
+        if (thrq_receive(&q, &v, sizeof(v), 0.1) != sizeof(v) || v != i)
+            break;
+    }
+    check(v == 3 && thrq_empty(&q), "spsc receive in order");
+    thrq_destroy(&q);
+}
+
+/*
+ * producers keep fewer messages in flight than the ring holds, send must never fail.
+ * one consumer: with more, the tail may lap a slot whose receive was preempted,
+ * that ring is full by design (see thrq_ring_full)
+ */
+#define NFLIGHT     200         /* per producer, NTHR * NFLIGHT < capacity */
+
+typedef struct {
+    thrq_cb_t*  q;
+    int         id;
+    int*        done;           /* messages received of every producer */
+    int*        received;
+    int         eagain;
+    int         error;
+} flight_t;
+
+void* flight_producer(void *arg)
+{
+    flight_t *f = (flight_t *)arg;
+
+    for (int seq = 0; seq < NMSG; ) {
+        if (seq - __atomic_load_n(&f->done[f->id], __ATOMIC_ACQUIRE) >= NFLIGHT) {
+            sched_yield();
+            continue;
+        }
+        msg_t m = { f->id, seq };
+        if (thrq_send(f->q, &m, sizeof(m)) == 0) {
+            seq++;
+        } else {
+            f->eagain++;
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+void* flight_consumer(void *arg)
+{
+    flight_t *f = (flight_t *)arg;
+    msg_t m;
+
+    while (__atomic_load_n(f->received, __ATOMIC_RELAXED) < NTHR * NMSG) {
+        if (thrq_receive(f->q, &m, sizeof(m), 0.05) == sizeof(m)) {
+            if (m.prod < 0 || m.prod >= NTHR)
+                f->error = 1;
+            else
+                __atomic_add_fetch(&f->done[m.prod], 1, __ATOMIC_RELEASE);
+            __atomic_add_fetch(f->received, 1, __ATOMIC_RELAXED);
+        } else if (errno != ETIMEDOUT) {
+            f->error = 1;
+        }
+    }
+    return NULL;
+}
+
+static void mpmc_below_capacity(void)
+{
+    thrq_cb_t q;
+    flight_t prod[NTHR], cons;
+    pthread_t tp[NTHR], tc;
+    int done[NTHR] = {0};
+    int received = 0, eagain = 0;
+
+    thrq_init(&q);
+    thrq_set_ring(&q, THRQ_MODE_MPMC, 1024, sizeof(msg_t));
+    thrq_set_maxsize(&q, 1 << 20);
+    for (int i=0; i<NTHR; i++) {
+        memset(&prod[i], 0, sizeof(flight_t));
+        prod[i].q = &q;
+        prod[i].id = i;
+        prod[i].done = done;
+        prod[i].received = &received;
+        pthread_create(&tp[i], NULL, flight_producer, &prod[i]);
+    }
+    cons = prod[0];
+    pthread_create(&tc, NULL, flight_consumer, &cons);
+    for (int i=0; i<NTHR; i++) {
+        pthread_join(tp[i], NULL);
+        eagain += prod[i].eagain;
+    }
+    pthread_join(tc, NULL);
+    check(!cons.error && eagain == 0 && received == NTHR * NMSG && thrq_empty(&q), "mpmc no EAGAIN below capacity");
+    thrq_destroy(&q);
+}
+
+static void test_mpmc(void)
+{
+    thrq_cb_t q;
+    int v = 0;
+    double t0;
+
+    run_checksum(THRQ_MODE_MPMC, THRQ_WAIT_COND, &run_copy);
+
+    thrq_init(&q);
+    check(thrq_set_ring(&q, THRQ_MODE_MPMC, 4, sizeof(v)) == 0, "mpmc set_ring");
+    t0 = now();
+    check_timeout(thrq_receive(&q, &v, sizeof(v), 0.1) < 0, t0, 0.1, "mpmc receive timeout on empty queue");
+    for (int i=0; i<4; i++)
+        thrq_send(&q, &i, sizeof(i));
+    check(thrq_send(&q, &v, sizeof(v)) < 0 && errno == EAGAIN && thrq_count(&q) == 4, "mpmc send EAGAIN when full");
+    thrq_destroy(&q);
+
+    mpmc_below_capacity();
+}
+
+static void test_receive_n(void)
+{
+    for (int mode = THRQ_MODE_LIST; mode <= THRQ_MODE_MPMC; mode++)
+        run_checksum(mode, THRQ_WAIT_COND, &run_recv_n);
+}
+
+static void test_send_n(void)
+{
+    for (int mode = THRQ_MODE_LIST; mode <= THRQ_MODE_MPMC; mode++)
+        run_checksum(mode, THRQ_WAIT_COND, &run_send_n);
+}
+
+/* MPMC slot reserved but not committed is no message yet, a discarded one is never */
+static void mpmc_reserved(int wait)
+{
+    thrq_cb_t q;
+    char buf[8] = {0};
+    struct iovec iov = { buf, sizeof(buf) };
+    double t0;
+
+    thrq_init(&q);
+    thrq_set_ring(&q, THRQ_MODE_MPMC, 4, sizeof(buf));
+    thrq_set_wait(&q, wait, 100);
+    void *p = thrq_reserve(&q, sizeof(buf));
+    check(p != NULL, "mpmc reserve");
+    t0 = now();
+    check_timeout(thrq_receive(&q, buf, sizeof(buf), 0.1) < 0, t0, 0.1, "mpmc receive timeout while reserved");
+    t0 = now();
+    check_timeout(thrq_receive_n(&q, &iov, 1, 0.1) < 0, t0, 0.1, "mpmc receive_n timeout while reserved");
+    t0 = now();
+    check_timeout(thrq_peek(&q, NULL, 0.1) == NULL, t0, 0.1, "mpmc peek timeout while reserved");
+
+    thrq_commit(&q, p, 0);
+    check(thrq_count(&q) == 0 && thrq_empty(&q), "mpmc discarded slot not counted");
+    t0 = now();
+    check_timeout(thrq_receive(&q, buf, sizeof(buf), 0.1) < 0, t0, 0.1, "mpmc receive timeout after discard");
+
+    p = thrq_reserve(&q, sizeof(buf));
+    thrq_commit(&q, p, sizeof(buf));
+    check(thrq_count(&q) == 1 && thrq_receive(&q, buf, sizeof(buf), 0.1) == sizeof(buf), "mpmc commit after discard");
+    thrq_destroy(&q);
+}
+
+/* commit over the reserved length is refused, the reservation stays valid */
+static void commit_oversize(int mode)
+{
+    static const char *modes[] = { "list", "spsc", "mpmc" };
+    thrq_cb_t q;
+    char buf[16];
+    char what[128];
+
+    thrq_init(&q);
+    if (mode != THRQ_MODE_LIST)
+        thrq_set_ring(&q, mode, 4, 16);
+    void *p = thrq_reserve(&q, 8);
+    int r1 = thrq_commit(&q, p, 100000);
+    int e1 = errno;
+    int r2 = thrq_commit(&q, p, 9);
+    int e2 = errno;
+    int ok = p && r1 < 0 && e1 == EINVAL && r2 < 0 && e2 == EINVAL;
+    ok = ok && thrq_commit(&q, p, 8) == 0 && thrq_receive(&q, buf, sizeof(buf), 0.1) == 8 && thrq_empty(&q);
+    snprintf(what, sizeof(what), "%s commit over reserved length", modes[mode]);
+    check(ok, what);
+    thrq_destroy(&q);
+}
+
+static void test_zero_copy(void)
+{
+    for (int mode = THRQ_MODE_LIST; mode <= THRQ_MODE_MPMC; mode++) {
+        run_checksum(mode, THRQ_WAIT_COND, &run_zc);
+        commit_oversize(mode);
+    }
+    mpmc_reserved(THRQ_WAIT_COND);
+}
+
+static void test_send_timed(void)
+{
+    thrq_cb_t q;
+    char buf[8] = {0};
+    double t0;
+
+    /* MPMC ring full, the slot of the next lap is held by peek */
+    thrq_init(&q);
+    thrq_set_ring(&q, THRQ_MODE_MPMC, 4, sizeof(buf));
+    for (int i=0; i<4; i++)
+        thrq_send(&q, buf, sizeof(buf));
+    const void *p = thrq_peek(&q, NULL, 0.1);
+    check(p != NULL, "mpmc peek on full ring");
+    t0 = now();
+    check_timeout(thrq_send_timed(&q, buf, sizeof(buf), 0.1) < 0, t0, 0.1, "mpmc send_timed timeout while slot held");
+    thrq_release(&q, p);
+    check(thrq_send_timed(&q, buf, sizeof(buf), 0.1) == 0, "mpmc send_timed after release");
+    thrq_destroy(&q);
+
+    /* list full */
+    thrq_init(&q);
+    thrq_set_maxsize(&q, 2);
+    thrq_send(&q, buf, sizeof(buf));
+    thrq_send(&q, buf, sizeof(buf));
+    t0 = now();
+    check_timeout(thrq_send_timed(&q, buf, sizeof(buf), 0.1) < 0, t0, 0.1, "list send_timed timeout when full");
+    thrq_destroy(&q);
+}
+
+static void test_spin_wait(void)
+{
+    for (int mode = THRQ_MODE_LIST; mode <= THRQ_MODE_MPMC; mode++) {
+        run_checksum(mode, THRQ_WAIT_SPIN, &run_copy);
+        run_checksum(mode, THRQ_WAIT_SPIN, &run_zc);
+    }
+    mpmc_reserved(THRQ_WAIT_SPIN);
+}
+
+void* late_sender(void *arg)
+{
+    struct timespec ts = { 0, 50*1000*1000 };
+    int v = 7;
+
+    nanosleep(&ts, NULL);
+    thrq_send((thrq_cb_t *)arg, &v, sizeof(v));
+    return NULL;
+}
+
+static void test_select(void)
+{
+    thrq_cb_t q[3];
+    thrq_cb_t *qs[3] = { &q[0], &q[1], &q[2] };
+    int v, hits[3] = {0};
+    double t0;
+
+    thrq_init(&q[0]);
+    thrq_init(&q[1]);
+    thrq_init(&q[2]);
+    thrq_set_ring(&q[1], THRQ_MODE_SPSC, 256, sizeof(int));
+    thrq_set_ring(&q[2], THRQ_MODE_MPMC, 256, sizeof(int));
+    thrq_set_wait(&q[2], THRQ_WAIT_SPIN, 100);
+
+    t0 = now();
+    check_timeout(thrq_select(qs, 3, 0.1) < 0, t0, 0.1, "select timeout on empty queues");
+    check(thrq_select(qs, 0, 0.1) < 0 && errno == EINVAL, "select invalid args");
+
+    /* reserved & discarded MPMC slots are not ready */
+    void *p = thrq_reserve(&q[2], sizeof(int));
+    t0 = now();
+    check_timeout(thrq_select(qs, 3, 0.1) < 0, t0, 0.1, "select timeout while mpmc slot reserved");
+    thrq_commit(&q[2], p, 0);
+    t0 = now();
+    check_timeout(thrq_select(qs, 3, 0.1) < 0, t0, 0.1, "select timeout on mpmc discarded slot");
+
+    /* wakeup by a send from another thread */
+    pthread_t tid;
+    pthread_create(&tid, NULL, late_sender, &q[2]);
+    t0 = now();
+    int idx = thrq_select(qs, 3, 2.0);
+    check(idx == 2 && now() - t0 < 1.0 && thrq_receive(&q[2], &v, sizeof(v), 0.1) == sizeof(v) && v == 7,
+          "select wakeup on send");
+    pthread_join(tid, NULL);
+
+    /* all busy: every queue is reported in turn */
+    for (int i=0; i<100; i++) {
+        thrq_send(&q[0], &i, sizeof(i));
+        thrq_send(&q[1], &i, sizeof(i));
+        thrq_send(&q[2], &i, sizeof(i));
+    }
+    for (int i=0; i<30; i++) {
+        idx = thrq_select(qs, 3, 0.1);
+        if (idx < 0 || thrq_receive(qs[idx], &v, sizeof(v), 0.1) != sizeof(v))
+            break;
+        hits[idx]++;
+    }
+    check(hits[0] == 10 && hits[1] == 10 && hits[2] == 10, "select fair between busy queues");
+
+    thrq_destroy(&q[0]);
+    thrq_destroy(&q[1]);
+    thrq_destroy(&q[2]);
+}
+
+#define NREF        2000        /* frames of ref fan-out stress */
+
+typedef struct {
+    thrq_cb_t   q;
+    mpool_t*    pool;
+    int         rounds;
+    int         left;           /* mpool_unref() of the last round */
+    int         error;
+} ref_worker_t;
+
+/* every frame carries its round number, a frame freed too early gets reused & overwritten */
+void* ref_consumer(void *arg)
+{
+    ref_worker_t *w = (ref_worker_t *)arg;
+
+    for (int r=0; r<w->rounds; r++) {
+        int *frame = (int *)thrq_receive_ref(&w->q, 1.0);
+        if (frame == NULL || frame[0] != r || frame[15] != r) {
+            w->error = 1;
+            return NULL;
+        }
+        sched_yield();
+        if (frame[0] != r || frame[15] != r)
+            w->error = 1;
+        w->left = mpool_unref(w->pool, frame);
+    }
+    return NULL;
+}
+
+static void ref_start(ref_worker_t *w, pthread_t *tid, int rounds)
+{
+    w->rounds = rounds;
+    w->error = 0;
+    pthread_create(tid, NULL, ref_consumer, w);
+}
+
+static void test_send_ref(void)
+{
+    mpool_t pool;
+    mpool_stats_t st;
+    ref_worker_t w[NTHR];
+    pthread_t tid[NTHR];
+    void *p[NTHR];
+    int ok = 1;
+
+    mpool_init_ex(&pool, NTHR, 16*sizeof(int), MPOOL_FLAG_STATS);
+    for (int i=0; i<NTHR; i++) {
+        memset(&w[i], 0, sizeof(ref_worker_t));
+        thrq_init(&w[i].q);
+        w[i].pool = &pool;
+    }
+
+    /* one frame to every consumer, the producer drops its own reference */
+    int *frame = (int *)mpool_malloc(&pool, 16*sizeof(int));
+    memset(frame, 0, 16*sizeof(int));
+    for (int i=0; i<NTHR; i++)
+        ok = ok && thrq_send_ref(&w[i].q, &pool, frame) == 0;
+    check(ok && mpool_unref(&pool, frame) == NTHR, "ref fan-out send");
+
+    /* all but the last consumer done: the frame is still out of the pool */
+    int left = 0;
+    for (int i=0; i<NTHR-1; i++)
+        ref_start(&w[i], &tid[i], 1);
+    for (int i=0; i<NTHR-1; i++) {
+        pthread_join(tid[i], NULL);
+        ok = ok && !w[i].error;
+        left += w[i].left;
+    }
+    mpool_stats(&pool, &st);
+    check(ok && left == NTHR*(NTHR-1)/2 && st.in_use == 1, "ref held until last unref");
+    for (int i=0; i<NTHR-1; i++)
+        ok = ok && (p[i] = mpool_malloc(&pool, 16*sizeof(int))) != NULL && p[i] != frame;
+    check(ok && mpool_malloc(&pool, 16*sizeof(int)) == NULL, "ref frame not in free list");
+    for (int i=0; i<NTHR-1; i++)
+        mpool_free(&pool, p[i]);
+
+    ref_start(&w[NTHR-1], &tid[NTHR-1], 1);
+    pthread_join(tid[NTHR-1], NULL);
+    mpool_stats(&pool, &st);
+    check(!w[NTHR-1].error && w[NTHR-1].left == 0 && st.in_use == 0, "ref last unref frees the frame");
+    for (int i=0; i<NTHR; i++)
+        ok = ok && (p[i] = mpool_malloc(&pool, 16*sizeof(int))) != NULL;
+    check(ok, "ref frame back in free list");
+    for (int i=0; i<NTHR; i++)
+        mpool_free(&pool, p[i]);
+
+    /* consumers unref concurrently, frames of the small pool are reused all the time */
+    for (int i=0; i<NTHR; i++)
+        ref_start(&w[i], &tid[i], NREF);
+    for (int r=0; r<NREF; ) {
+        frame = (int *)mpool_malloc(&pool, 16*sizeof(int));
+        if (frame == NULL) {
+            sched_yield();
+            continue;
+        }
+        for (int j=0; j<16; j++)
+            frame[j] = r;
+        for (int i=0; i<NTHR; i++)
+            thrq_send_ref(&w[i].q, &pool, frame);
+        mpool_unref(&pool, frame);
+        r++;
+    }
+    ok = 1;
+    for (int i=0; i<NTHR; i++) {
+        pthread_join(tid[i], NULL);
+        ok = ok && !w[i].error;
+        thrq_destroy(&w[i].q);
+    }
+    mpool_stats(&pool, &st);
+    check(ok && st.in_use == 0 && st.allocs == st.frees, "ref fan-out stress");
+    mpool_destroy(&pool);
+}
+
+static void test_prio(void)
+{
+    thrq_cb_t q;
+    msg_t m;
+    int ok = 1;
+
+    thrq_init(&q);
+    check(thrq_set_prio(&q, 0) < 0 && errno == EINVAL && thrq_set_prio(&q, THRQ_PRIO_MAX + 1) < 0 && errno == EINVAL,
+          "prio levels out of range");
+    check(thrq_set_prio(&q, 4) == 0, "prio set 4 levels");
+    m.prod = 4;
+    check(thrq_send_prio(&q, &m, sizeof(m), 4) < 0 && errno == EINVAL, "prio send to missing level");
+
+    /* levels interleaved, thrq_send is level 0; prod is the level, seq the order in it */
+    static const int order[] = { 1, 3, 0, 2 };
+    int next[4] = {0};
+    for (int round=0; round<3; round++) {
+        for (int i=0; i<4; i++) {
+            m.prod = order[i];
+            m.seq = next[m.prod]++;
+            ok = ok && thrq_send_prio(&q, &m, sizeof(m), m.prod) == 0;
+        }
+        m.prod = 0;
+        m.seq = next[0]++;
+        ok = ok && thrq_send(&q, &m, sizeof(m)) == 0;
+    }
+    check(ok && thrq_count(&q) == 15 && thrq_level_count(&q, 0) == 6 && thrq_level_count(&q, 3) == 3, "prio send");
+    thrq_cb_t r;
+    thrq_init(&r);
+    check(thrq_set_prio(&q, 2) < 0 && errno == EBUSY && thrq_set_ring(&r, THRQ_MODE_SPSC, 4, 8) == 0 &&
+          thrq_set_prio(&r, 2) < 0 && errno == EINVAL, "prio set on busy or ring queue");
+    thrq_destroy(&r);
+
+    int level = 3, seq = 0, across = 1, fifo = 1;
+    for (int i=0; i<15; i++) {
+        if (thrq_receive(&q, &m, sizeof(m), 0.1) != sizeof(m)) {
+            across = 0;
+            break;
+        }
+        if (m.prod != level) {
+            across = across && m.prod == level - 1 && seq == 3;
+            level = m.prod;
+            seq = 0;
+        }
+        fifo = fifo && m.seq == seq;
+        seq++;
+    }
+    check(across && level == 0 && seq == 6 && thrq_empty(&q), "prio receive order across levels");
+    check(fifo, "prio fifo within a level");
+
+    /* a full level refuses, other levels & the queue still have room */
+    thrq_set_maxsize(&q, 100);
+    check(thrq_set_level_maxsize(&q, 4, 2) < 0 && errno == EINVAL, "prio level maxsize of missing level");
+    check(thrq_set_level_maxsize(&q, 1, 2) == 0, "prio level maxsize");
+    for (int i=0; i<2; i++) {
+        m.prod = 1;
+        m.seq = i;
+        ok = ok && thrq_send_prio(&q, &m, sizeof(m), 1) == 0;
+    }
+    check(ok && thrq_send_prio(&q, &m, sizeof(m), 1) < 0 && errno == EAGAIN && thrq_count(&q) == 2,
+          "prio EAGAIN on full level");
+    m.prod = 2;
+    check(thrq_send_prio(&q, &m, sizeof(m), 2) == 0 && thrq_send(&q, &m, sizeof(m)) == 0 &&
+          thrq_level_count(&q, 1) == 2, "prio other levels not limited");
+    thrq_receive(&q, &m, sizeof(m), 0.1);
+    ok = (m.prod == 2 && thrq_receive(&q, &m, sizeof(m), 0.1) == sizeof(m) && m.prod == 1 && m.seq == 0);
+    check(ok && thrq_send_prio(&q, &m, sizeof(m), 1) == 0, "prio level has room after receive");
+    thrq_destroy(&q);
+}
+
+/* fd of the queue is readable within ms */
+static int fd_readable(thrq_cb_t *q, int ms)
+{
+    struct pollfd pfd = { thrq_fd(q), POLLIN, 0 };
+    return poll(&pfd, 1, ms) == 1 && (pfd.revents & POLLIN);
+}
+
+static void test_eventfd(void)
+{
+    thrq_cb_t q;
+    int v = 0, w[2];
+    struct iovec iov[2] = { { &w[0], sizeof(int) }, { &w[1], sizeof(int) } };
+
+    thrq_init(&q);
+    check(thrq_fd(&q) < 0 && errno == EINVAL, "eventfd not enabled");
+    thrq_set_ring(&q, THRQ_MODE_MPMC, 4, sizeof(int));
+    check(thrq_set_eventfd(&q, 1) < 0 && errno == EINVAL, "eventfd on ring");
+    thrq_destroy(&q);
+
+    thrq_init(&q);
+    check(thrq_set_eventfd(&q, 1) == 0 && thrq_fd(&q) >= 0 && !fd_readable(&q, 0), "eventfd empty not readable");
+    thrq_send(&q, &v, sizeof(v));
+    check(fd_readable(&q, 0), "eventfd readable after send");
+    thrq_send(&q, &v, sizeof(v));
+    thrq_receive(&q, &v, sizeof(v), 0.1);
+    check(fd_readable(&q, 0), "eventfd readable while not empty");
+    thrq_receive(&q, &v, sizeof(v), 0.1);
+    check(!fd_readable(&q, 0), "eventfd not readable after drain");
+    thrq_send(&q, &v, sizeof(v));
+    check(fd_readable(&q, 0), "eventfd readable again after send");
+    thrq_send(&q, &v, sizeof(v));
+    check(thrq_receive_n(&q, iov, 2, 0.1) == 2 && !fd_readable(&q, 0), "eventfd not readable after receive_n");
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, late_sender, &q);
+    double t0 = now();
+    check(fd_readable(&q, 2000) && now() - t0 < 1.0 && thrq_receive(&q, &v, sizeof(v), 0.1) == sizeof(v) && v == 7,
+          "eventfd poll wakeup on send");
+    pthread_join(tid, NULL);
+
+    check(thrq_set_eventfd(&q, 0) == 0 && thrq_fd(&q) < 0, "eventfd disabled");
+    thrq_destroy(&q);
+}
+
+int main()
+{
+    test_spsc();
+    test_mpmc();
+    test_receive_n();
+    test_send_n();
+    test_zero_copy();
+    test_send_timed();
+    test_prio();
+    test_eventfd();
+    test_spin_wait();
+    test_select();
+    test_send_ref();
+    return 0;
+}
@@ -0,0 +1,189 @@
+/**
+ * @file    arena.c
+ * @author  ln
+ * @brief   bump pointer arena, alloc many & free all at once
+ **/
+
+#include "arena.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARENA_ROUND_UP(x)       (((x) + (ARENA_ALIGN - 1)) & ~((size_t)ARENA_ALIGN - 1))
+#define ARENA_CHUNK_DATA(c)     ((char *)ARENA_ROUND_UP((uintptr_t)(c)->data))
+
+/**
+ * @brief   init arena, no memory allocated until the first arena_malloc()
+ * @param   arena       arena to init
+ *          chunk_size  bytes of each chunk, 0 is ARENA_CHUNK_SIZE_DEFAULT
+ *
+ * @return  0 is ok
+ **/
+int arena_init(arena_t *arena, size_t chunk_size)
+{
+    if (arena == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    arena->first = NULL;
+    arena->chunk = NULL;
+    arena->ptr = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE_DEFAULT;
+    return 0;
+}
+
+/**
+ * @brief   create arena
+ * @param   chunk_size  bytes of each chunk, 0 is ARENA_CHUNK_SIZE_DEFAULT
+ * @return  pointer to the arena created
+ **/
+arena_t* arena_new(size_t chunk_size)
+{
+    arena_t *arena = (arena_t *)malloc(sizeof(arena_t));
+    if (arena)
+        arena_init(arena, chunk_size);
+    return arena;
+}
+
+/**
+ * @brief   free all chunks of the arena (except arena itself)
+ * @param   arena   arena to clean
+ * @return  void
+ **/
+void arena_destroy(arena_t *arena)
+{
+    if (arena) {
+        arena_chunk_t *c = arena->first;
+        while (c) {
+            arena_chunk_t *next = c->next;
+            free(c);
+            c = next;
+        }
+        arena_init(arena, arena->chunk_size);
+    }
+}
+
+/**
+ * @brief   move to a chunk which has room for size bytes
+ * @param   arena   arena
+ *          size    bytes wanted, rounded up to ARENA_ALIGN
+ *
+ * @return  0 is ok
+ *
+ * chunks after the current one are all unused, the first of them that is
+ * large enough is moved right after the current one and reused, a new
+ * chunk is linked there if none fits.
+ **/
+static int arena_next_chunk(arena_t *arena, size_t size)
+{
+    arena_chunk_t **link = arena->chunk ? &arena->chunk->next : &arena->first;
+    arena_chunk_t **pp = link;
+    arena_chunk_t *c;
+
+    while ((c = *pp) != NULL && (size_t)(c->end - ARENA_CHUNK_DATA(c)) < size)
+        pp = &c->next;
+
+    if (c) {
+        *pp = c->next;
+    } else {
+        size_t bytes = (size > arena->chunk_size) ? size : arena->chunk_size;
+        c = (arena_chunk_t *)malloc(sizeof(arena_chunk_t) + ARENA_ALIGN + bytes);
+        if (c == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        c->end = ARENA_CHUNK_DATA(c) + bytes;
+    }
+    c->next = *link;
+    *link = c;
+
+    arena->chunk = c;
+    arena->ptr = ARENA_CHUNK_DATA(c);
+    return 0;
+}
+
+/**
+ * @brief   alloc memory from arena
+ * @param   arena   arena
+ *          size    bytes wanted
+ *
+ * @return  memory aligned to ARENA_ALIGN, NULL is returned on error
+ *
+ * no header per allocation, memory is only returned by reset/restore/destroy
+ **/
+void* arena_malloc(arena_t *arena, size_t size)
+{
+    if (arena == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size = ARENA_ROUND_UP(size);
+    if (arena->chunk == NULL || (size_t)(arena->chunk->end - arena->ptr) < size) {
+        if (arena_next_chunk(arena, size) != 0)
+            return NULL;
+    }
+
+    void *p = arena->ptr;
+    arena->ptr += size;
+    return p;
+}
+
+/**
+ * @brief   arena_malloc() as the allocator callback of cstr, e.g. abin2hex_ex()
+ * @param   arena   pointer to arena_t
+ *          size    bytes wanted
+ *
+ * @return  memory allocated
+ **/
+void* arena_allocator(void *arena, size_t size)
+{
+    return arena_malloc((arena_t *)arena, size);
+}
+
+/**
+ * @brief   save current position of arena
+ * @param   arena   arena
+ * @return  mark for arena_restore()
+ **/
+arena_mark_t arena_mark(arena_t *arena)
+{
+    arena_mark_t mark;
+    mark.chunk = arena->chunk;
+    mark.ptr = arena->ptr;
+    return mark;
+}
+
+/**
+ * @brief   free all memory allocated after the mark, O(1)
+ * @param   arena   arena
+ *          mark    position returned by arena_mark()
+ *
+ * @return  void
+ *
+ * marks can be nested, restoring an outer mark drops all inner ones
+ **/
+void arena_restore(arena_t *arena, arena_mark_t mark)
+{
+    arena->chunk = mark.chunk;
+    arena->ptr = mark.ptr;
+}
+
+/**
+ * @brief   free all memory allocated from arena, O(1)
+ * @param   arena   arena
+ * @return  void
+ *
+ * chunks are kept and reused by the following allocations
+ **/
+void arena_reset(arena_t *arena)
+{
+    arena->chunk = NULL;
+    arena->ptr = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,56 @@
+/**
+ * @file    arena.h
+ * @author  ln
+ * @brief   bump pointer arena, alloc many & free all at once
+ **/
+
+#ifndef __MEMORY_ARENA__
+#define __MEMORY_ARENA__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ARENA_CHUNK_SIZE_DEFAULT        (64*1024)
+#define ARENA_ALIGN                     16          /* alignment of every allocation */
+
+typedef struct __arena_chunk {
+    struct __arena_chunk*   next;       /* chunks are kept until arena destroyed */
+    char*                   end;
+    char                    data[];     /* flexible array */
+} arena_chunk_t;
+
+/* not thread safe, one arena per thread or per request */
+typedef struct {
+    arena_chunk_t*  first;
+    arena_chunk_t*  chunk;          /* current chunk, NULL if nothing allocated */
+    char*           ptr;            /* bump pointer in current chunk */
+    size_t          chunk_size;
+} arena_t;
+
+/* saved arena position, see arena_mark() */
+typedef struct {
+    arena_chunk_t*  chunk;
+    char*           ptr;
+} arena_mark_t;
+
+extern int          arena_init      (arena_t *arena, size_t chunk_size);
+extern arena_t*     arena_new       (size_t chunk_size);
+extern void         arena_destroy   (arena_t *arena);
+
+extern void*        arena_malloc    (arena_t *arena, size_t size);
+extern void*        arena_allocator (void *arena, size_t size);
+
+extern arena_mark_t arena_mark      (arena_t *arena);
+extern void         arena_restore   (arena_t *arena, arena_mark_t mark);
+extern void         arena_reset     (arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,3 +1,3 @@
-gcc -c -Wall -DDEBUG thrq.c que.c mux.c cstr.c log.c mpool.c popen_p.c
+gcc -c -Wall -DDEBUG thrq.c que.c mux.c cstr.c log.c mpool.c mpool_slab.c arena.c fpool.c shmpool.c popen_p.c
 ar crv libutils.a *.o
 rm -f *.o
@@ -101,13 +101,27 @@ int bin2hex(char *hex, const void *bin, unsigned len)
  * Need to free the pointer returned from this func
  **/
 char* abin2hex(const void *bin, unsigned len)
+{
+    return abin2hex_ex(bin, len, NULL, NULL);
+}
+
+/**
+ * @brief   Convert bin to hex & allocate output buffer by allocator
+ * @param   bin         bin to convert
+ *          len         lenght of the bin to convert
+ *          alloc       allocator, NULL is malloc
+ *          ctx         first argument of allocator, e.g. arena_t* of arena_allocator()
+ *
+ * @return  pointer to the ouput char buffer
+ **/
+char* abin2hex_ex(const void *bin, unsigned len, cstr_alloc_t alloc, void *ctx)
 {
     if (bin == NULL || len == 0) {
         errno = EINVAL;
         return NULL;
     }
 
-    char *s = (char*)malloc((len * 2) + 1);
+    char *s = alloc ? (char*)alloc(ctx, (len * 2) + 1) : (char*)malloc((len * 2) + 1);
     if (s != NULL) {
         bin2hex(s, bin, len);
     } else {
@@ -161,6 +175,19 @@ int hex2bin(void *bin, const char *hex, unsigned len)
  * Need to free the pointer returned from this func
  **/
 void * ahex2bin(const char *hex)
+{
+    return ahex2bin_ex(hex, NULL, NULL);
+}
+
+/**
+ * @brief   Convert hex to bin & allocate output buffer by allocator
+ * @param   hex         hex to convert
+ *          alloc       allocator, NULL is malloc
+ *          ctx         first argument of allocator, e.g. arena_t* of arena_allocator()
+ *
+ * @return  pointer to the ouput bin buffer
+ **/
+void * ahex2bin_ex(const char *hex, cstr_alloc_t alloc, void *ctx)
 {
     if (hex == NULL) {
         errno = EINVAL;
@@ -168,7 +195,7 @@ void * ahex2bin(const char *hex)
     }
 
     unsigned len = strlen(hex);
-    unsigned char *b = (unsigned char*)malloc(len/2 + 1);
+    unsigned char *b = alloc ? (unsigned char*)alloc(ctx, len/2 + 1) : (unsigned char*)malloc(len/2 + 1);
     if (b != NULL) {
         hex2bin(b, hex, len/2 + 1);
     } else {
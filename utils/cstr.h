@@ -25,6 +25,9 @@ extern "C" {
 #define _CONCAT_STRING(l, r)    l##r
 #define CONCAT_STRING(l, r)     _CONCAT_STRING(l, r)
 
+/* allocator of a* functions, ctx is user defined */
+typedef void*   (*cstr_alloc_t)(void *ctx, size_t size);
+
 extern char*    strlwr          (char *s);
 extern char*    strupr          (char *s);
 
@@ -32,9 +35,11 @@ extern int      strstrip        (char *s);
 
 extern int      bin2hex         (char *hex, const void *bin, unsigned len);
 extern char*    abin2hex        (const void *bin, unsigned len);
+extern char*    abin2hex_ex     (const void *bin, unsigned len, cstr_alloc_t alloc, void *ctx);
 
 extern int      hex2bin         (void *bin, const char *hex, unsigned len);
 extern void*    ahex2bin        (const char *hex);
+extern void*    ahex2bin_ex     (const char *hex, cstr_alloc_t alloc, void *ctx);
 
 extern int      memswap         (void *out, const void *in, unsigned len, unsigned section_size);
 
@@ -0,0 +1,148 @@
+/**
+ * @file    fpool.c
+ * @author  ln
+ * @brief   header-free fixed size memory pool
+ **/
+
+#include "fpool.h"
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FPOOL_WORD_BITS     64
+
+/**
+ * @brief   init fixed size pool
+ * @param   fpool       pool to init
+ *          n           number of blocks
+ *          data_size   size of each block
+ *
+ * @return  0 is ok
+ *
+ * block stride is data_size rounded up to 8 bytes (exactly data_size if < 8),
+ * so a pool of 8 bytes blocks has no overhead except one bit per block.
+ **/
+int fpool_init(fpool_t *fpool, size_t n, size_t data_size)
+{
+    if (fpool == NULL || n == 0 || data_size == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fpool->n = n;
+    fpool->data_size = data_size;
+    fpool->block_size = (data_size < 8) ? data_size : ((data_size + 7) & ~(size_t)7);
+    fpool->shift = (fpool->block_size & (fpool->block_size - 1)) ? -1 : __builtin_ctzl(fpool->block_size);
+    fpool->nwords = (n + FPOOL_WORD_BITS - 1) / FPOOL_WORD_BITS;
+    fpool->hint = 0;
+
+    fpool->buffer = (char *)malloc(n * fpool->block_size);
+    fpool->bitmap = (uint64_t *)malloc(fpool->nwords * sizeof(uint64_t));
+    if (fpool->buffer == NULL || fpool->bitmap == NULL) {
+        free(fpool->buffer);
+        free(fpool->bitmap);
+        fpool->buffer = NULL;
+        fpool->bitmap = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(fpool->bitmap, 0xff, fpool->nwords * sizeof(uint64_t));
+    if (n % FPOOL_WORD_BITS)
+        fpool->bitmap[fpool->nwords - 1] = ((uint64_t)1 << (n % FPOOL_WORD_BITS)) - 1;
+    return 0;
+}
+
+/**
+ * @brief   create fixed size pool
+ * @param   n           number of blocks
+ *          data_size   size of each block
+ *
+ * @return  pointer to the pool created
+ **/
+fpool_t* fpool_new(size_t n, size_t data_size)
+{
+    fpool_t *fp = (fpool_t *)malloc(sizeof(fpool_t));
+    if (fp && (fpool_init(fp, n, data_size) != 0)) {
+        free(fp);
+        fp = NULL;
+    }
+    return fp;
+}
+
+/**
+ * @brief   free buffer & bitmap of the pool (except pool itself)
+ * @param   fpool   pool to clean
+ * @return  0 is ok
+ **/
+int fpool_destroy(fpool_t *fpool)
+{
+    if (fpool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    free(fpool->buffer);
+    free(fpool->bitmap);
+    fpool->buffer = NULL;
+    fpool->bitmap = NULL;
+    fpool->n = 0;
+    fpool->nwords = 0;
+    return 0;
+}
+
+/**
+ * @brief   alloc a block, lock-free
+ * @param   fpool   pool
+ *          size    size wanted, <= data_size
+ *
+ * @return  block allocated, NULL is returned and errno is ENOMEM if exhausted
+ *
+ * scan bitmap words from the hint, pick the first set bit & clear it by CAS
+ **/
+void* fpool_malloc(fpool_t *fpool, size_t size)
+{
+    if (fpool == NULL || size > fpool->data_size) {
+        errno = (fpool == NULL) ? EINVAL : ENOMEM;
+        return NULL;
+    }
+
+    size_t start = __atomic_load_n(&fpool->hint, __ATOMIC_RELAXED);
+    for (size_t k=0; k<fpool->nwords; k++) {
+        size_t i = (start + k) % fpool->nwords;
+        uint64_t w = __atomic_load_n(&fpool->bitmap[i], __ATOMIC_RELAXED);
+        while (w) {
+            const int bit = __builtin_ctzll(w);
+            if (__atomic_compare_exchange_n(&fpool->bitmap[i], &w, w & ~((uint64_t)1 << bit),
+                                            1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                if (i != start)
+                    __atomic_store_n(&fpool->hint, i, __ATOMIC_RELAXED);
+                return fpool->buffer + (i*FPOOL_WORD_BITS + bit) * fpool->block_size;
+            }
+        }
+    }
+
+    errno = ENOMEM;
+    return NULL;
+}
+
+/**
+ * @brief   free a block, lock-free
+ * @param   fpool   pool
+ *          mem     block to free
+ *
+ * @return  void
+ **/
+void fpool_free(fpool_t *fpool, void *mem)
+{
+    if (fpool && mem) {
+        const size_t off = (char *)mem - fpool->buffer;
+        const size_t idx = (fpool->shift >= 0) ? (off >> fpool->shift) : (off / fpool->block_size);
+        __atomic_fetch_or(&fpool->bitmap[idx / FPOOL_WORD_BITS], (uint64_t)1 << (idx % FPOOL_WORD_BITS), __ATOMIC_RELEASE);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
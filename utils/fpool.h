@@ -0,0 +1,45 @@
+/**
+ * @file    fpool.h
+ * @author  ln
+ * @brief   header-free fixed size memory pool
+ **/
+
+#ifndef __FIXED_MEMORY_POOL__
+#define __FIXED_MEMORY_POOL__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * blocks are packed without header, free slots are tracked by a bitmap
+ * outside the buffer (bit set is free). alloc & free are lock-free.
+ **/
+typedef struct {
+    char*       buffer;         /* n blocks, tightly packed */
+    uint64_t*   bitmap;         /* one bit per block, set is free */
+    size_t      nwords;         /* number of bitmap words */
+    size_t      n;              /* number of blocks */
+    size_t      data_size;
+    size_t      block_size;     /* block stride */
+    int         shift;          /* log2 of block_size, -1 if not power of 2 */
+    size_t      hint;           /* bitmap word to start searching */
+} fpool_t;
+
+extern int          fpool_init          (fpool_t *fpool, size_t n, size_t data_size);
+extern fpool_t*     fpool_new           (size_t n, size_t data_size);
+extern int          fpool_destroy       (fpool_t *fpool);
+
+extern void*        fpool_malloc        (fpool_t *fpool, size_t size);
+extern void         fpool_free          (fpool_t *fpool, void *mem);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
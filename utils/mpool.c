@@ -5,6 +5,13 @@
  **/
 
 #include "mpool.h"
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,6 +20,423 @@ extern "C" {
 #define OFFSET_OF(TYPE, MEMBER)             ((size_t)&((TYPE *)0)->MEMBER)
 #define CONTAINER_OF(ptr, type, member)     ((type *)((char *)(ptr) - OFFSET_OF(type,member)))
 
+/* lock-free free list is used in static modes only */
+#define MPOOL_LOCKFREE(mp)                  (((mp)->flags & MPOOL_FLAG_LOCKFREE) && \
+                                             ((mp)->mode == MPOOL_MODE_ISTATIC || (mp)->mode == MPOOL_MODE_ESTATIC))
+
+#define MPOOL_STAT_ADD(mp, st, v)           __atomic_fetch_add(&(mp)->st, (v), __ATOMIC_RELAXED)
+#define MPOOL_STAT_GET(mp, st)              __atomic_load_n(&(mp)->st, __ATOMIC_RELAXED)
+/* alloc/free/occupancy counters: magazines batch them, shared per-op counters are opt-in */
+#define MPOOL_STATS_ON(mp)                  ((mp)->mag_size > 0 || ((mp)->flags & MPOOL_FLAG_STATS))
+/* counter only written by its owner thread */
+#define MPOOL_STAT_INC_OWNER(p, st)         __atomic_store_n(&(p)->st, (p)->st + 1, __ATOMIC_RELAXED)
+
+#define MPOOL_LF_INDEX(head)                ((uint32_t)(head))
+#define MPOOL_LF_TAG(head)                  ((uint32_t)((head) >> 32))
+#define MPOOL_LF_MAKE(tag, index)           (((uint64_t)(tag) << 32) | (uint64_t)(index))
+#define MPOOL_LF_INDEX_OF(mp, p)            ((uint32_t)(((char *)(p) - (mp)->base) / (mp)->block_size) + 1)
+
+/* DGROWN chunk: header followed by nblocks blocks */
+struct __mpool_chunk {
+    size_t                      nblocks;
+    size_t                      nfree;      /* scratch of mpool_trim() */
+    char*                       base;       /* first block */
+};
+
+/* per-thread magazine: a small stack of blocks owned by one thread */
+struct __mpool_mag {
+    LIST_ENTRY(__mpool_mag)     entry;
+    mpool_t*                    mpool;
+    int                         count;
+    uint64_t                    hits;       /* written by owner thread only */
+    uint64_t                    misses;
+    uint64_t                    allocs;
+    uint64_t                    frees;
+    mpool_elm_t*                blocks[];   /* flexible array */
+};
+
+/**
+ * @brief   map anonymous memory for ISTATIC buffer
+ * @param   size        bytes wanted
+ *          flags       MPOOL_FLAG_xxx
+ *          map_size    output, bytes mapped for munmap
+ *
+ * @return  buffer mapped, NULL is returned on error and errno is set
+ *
+ * THP buffer is aligned to MPOOL_HUGEPAGE_SIZE so that the kernel can back
+ * it with huge pages, it's prefaulted after madvise() if POPULATE given.
+ **/
+static char* mpool_map_buffer(size_t size, int flags, size_t *map_size)
+{
+    int mflags = MAP_PRIVATE | MAP_ANONYMOUS;
+    char *buf;
+
+    if (flags & (MPOOL_FLAG_HUGETLB | MPOOL_FLAG_THP))
+        size = (size + MPOOL_HUGEPAGE_SIZE - 1) & ~((size_t)MPOOL_HUGEPAGE_SIZE - 1);
+
+    if (flags & MPOOL_FLAG_HUGETLB) {
+        mflags |= MAP_HUGETLB;
+    }
+    if ((flags & MPOOL_FLAG_POPULATE) && !(flags & MPOOL_FLAG_THP)) {
+        mflags |= MAP_POPULATE;
+    }
+
+    if ((flags & MPOOL_FLAG_THP) && !(flags & MPOOL_FLAG_HUGETLB)) {
+        char *raw = (char *)mmap(NULL, size + MPOOL_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, mflags, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+        buf = (char *)(((size_t)raw + MPOOL_HUGEPAGE_SIZE - 1) & ~((size_t)MPOOL_HUGEPAGE_SIZE - 1));
+        if (buf > raw)
+            munmap(raw, buf - raw);
+        munmap(buf + size, raw + MPOOL_HUGEPAGE_SIZE - buf);
+#ifdef MADV_HUGEPAGE
+        madvise(buf, size, MADV_HUGEPAGE);
+#endif
+        if (flags & MPOOL_FLAG_POPULATE) {
+            long page = sysconf(_SC_PAGESIZE);
+            for (size_t off = 0; off < size; off += page)
+                buf[off] = 0;
+        }
+    } else {
+        buf = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, mflags, -1, 0);
+        if (buf == MAP_FAILED)
+            return NULL;
+    }
+
+    if ((flags & MPOOL_FLAG_MLOCK) && mlock(buf, size) != 0) {
+        const int err = errno;
+        munmap(buf, size);
+        errno = err;
+        return NULL;
+    }
+
+    *map_size = size;
+    return buf;
+}
+
+/**
+ * @brief   get data alignment of the flags
+ * @param   flags   MPOOL_FLAG_xxx
+ * @return  alignment
+ **/
+static size_t mpool_flags_align(int flags)
+{
+    if (flags & MPOOL_FLAG_ALIGN_PAGE)
+        return MPOOL_ALIGN_PAGE;
+    if (flags & MPOOL_FLAG_ALIGN64)
+        return MPOOL_ALIGN_CACHELINE;
+    return MPOOL_ALIGN_DEFAULT;
+}
+
+/**
+ * @brief   grow a DGROWN pool by one chunk, link its blocks into free list
+ * @param   mpool   memory pool, locked
+ * @return  0 is ok
+ *
+ * chunks are kept sorted by address for mpool_trim()
+ **/
+static int mpool_grow(mpool_t *mpool)
+{
+    size_t nblocks = mpool->chunk_blocks;
+    if (nblocks == 0)
+        nblocks = (mpool->block_size < MPOOL_CHUNK_SIZE_DEFAULT) ? MPOOL_CHUNK_SIZE_DEFAULT / mpool->block_size : 1;
+    const size_t off = MPOOL_BLOCK_SIZE_ALIGN(sizeof(mpool_chunk_t), mpool->align) + MPOOL_BLOCK_PAD(mpool->align);
+
+    mpool_chunk_t **chunks = (mpool_chunk_t **)realloc(mpool->chunks, (mpool->nchunks + 1) * sizeof(mpool_chunk_t *));
+    if (chunks == NULL)
+        return -1;
+    mpool->chunks = chunks;
+
+    mpool_chunk_t *c;
+    if (posix_memalign((void **)&c, mpool->align, off + nblocks * mpool->block_size) != 0)
+        return -1;
+    c->nblocks = nblocks;
+    c->nfree = 0;
+    c->base = (char *)c + off;
+
+    size_t k = mpool->nchunks;
+    while (k > 0 && chunks[k-1] > c) {
+        chunks[k] = chunks[k-1];
+        k--;
+    }
+    chunks[k] = c;
+    mpool->nchunks++;
+
+    for (size_t i=0; i<nblocks; i++) {
+        TAILQ_INSERT_TAIL(&mpool->hdr_free, (mpool_elm_t *)(c->base + mpool->block_size*i), entry);
+    }
+    mpool->n += nblocks;
+    MPOOL_STAT_ADD(mpool, st_grows, 1);
+    return 0;
+}
+
+/**
+ * @brief   find the DGROWN chunk of a block
+ * @param   mpool   memory pool, locked
+ *          p       block
+ *
+ * @return  chunk
+ **/
+static mpool_chunk_t* mpool_chunk_of(mpool_t *mpool, mpool_elm_t *p)
+{
+    size_t lo = 0, hi = mpool->nchunks;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if ((char *)mpool->chunks[mid] <= (char *)p)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return mpool->chunks[lo];
+}
+
+/**
+ * @brief   carve up to n never-used blocks from the static buffer
+ * @param   mpool   memory pool
+ *          blocks  output blocks
+ *          n       number of blocks wanted
+ *
+ * @return  number of blocks carved, 0 if the buffer is used up or the pool is not static
+ *
+ * Blocks are not linked into the free list at init, they are handed out in
+ * address order by bumping the carve counter, so init is O(1) and pages are
+ * only touched when first used. Freed blocks go to the free list as usual.
+ **/
+static size_t mpool_carve(mpool_t *mpool, mpool_elm_t **blocks, size_t n)
+{
+    if (mpool->mode != MPOOL_MODE_ISTATIC && mpool->mode != MPOOL_MODE_ESTATIC)
+        return 0;
+
+    size_t c = __atomic_load_n(&mpool->carve, __ATOMIC_RELAXED);
+    size_t k;
+    do {
+        if (c >= mpool->n)
+            return 0;
+        k = (mpool->n - c < n) ? mpool->n - c : n;
+    } while (!__atomic_compare_exchange_n(&mpool->carve, &c, c + k, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    for (size_t i=0; i<k; i++) {
+        blocks[i] = (mpool_elm_t *)(mpool->base + mpool->block_size*(c+i));
+    }
+    return k;
+}
+
+/**
+ * @brief   pop up to n blocks from the lock-free free list (Treiber stack)
+ * @param   mpool   memory pool
+ *          blocks  output blocks
+ *          n       number of blocks wanted
+ *
+ * @return  number of blocks poped, 0 if the pool is exhausted
+ *
+ * blocks are linked by index, the 32bit tag of the stack top avoids ABA.
+ * the chain is detached with one CAS, links read from blocks taken by
+ * others meanwhile are discarded as the tag has changed.
+ **/
+static size_t mpool_lf_pop(mpool_t *mpool, mpool_elm_t **blocks, size_t n)
+{
+    uint64_t head = __atomic_load_n(&mpool->lf_head, __ATOMIC_ACQUIRE);
+    uint64_t top;
+    uint32_t next;
+    size_t k;
+
+    do {
+        k = 0;
+        next = MPOOL_LF_INDEX(head);
+        while (k < n && next != 0 && next <= mpool->n) {
+            blocks[k] = (mpool_elm_t *)(mpool->base + mpool->block_size*(next - 1));
+            next = __atomic_load_n(&blocks[k]->next, __ATOMIC_RELAXED);
+            k++;
+        }
+        if (k == 0)
+            return 0;
+        top = MPOOL_LF_MAKE(MPOOL_LF_TAG(head) + 1, (next <= mpool->n) ? next : 0);
+    } while (!__atomic_compare_exchange_n(&mpool->lf_head, &head, top, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return k;
+}
+
+/**
+ * @brief   push n blocks to the lock-free free list (Treiber stack)
+ * @param   mpool   memory pool
+ *          blocks  blocks to push
+ *          n       number of blocks, > 0
+ *
+ * @return  void
+ *
+ * blocks are linked into a chain first, then spliced with one CAS
+ **/
+static void mpool_lf_push(mpool_t *mpool, mpool_elm_t **blocks, size_t n)
+{
+    for (size_t i=0; i+1<n; i++) {
+        __atomic_store_n(&blocks[i]->next, MPOOL_LF_INDEX_OF(mpool, blocks[i+1]), __ATOMIC_RELAXED);
+    }
+
+    const uint32_t index = MPOOL_LF_INDEX_OF(mpool, blocks[0]);
+    mpool_elm_t *last = blocks[n-1];
+    uint64_t head = __atomic_load_n(&mpool->lf_head, __ATOMIC_RELAXED);
+    uint64_t top;
+
+    do {
+        __atomic_store_n(&last->next, MPOOL_LF_INDEX(head), __ATOMIC_RELAXED);
+        top = MPOOL_LF_MAKE(MPOOL_LF_TAG(head) + 1, index);
+    } while (!__atomic_compare_exchange_n(&mpool->lf_head, &head, top, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief   lock the pool & account the time waited if contended
+ * @param   mpool   memory pool
+ * @return  0 is ok
+ **/
+static int mpool_lock(mpool_t *mpool)
+{
+    struct timespec t0, t1;
+
+    if (pthread_mutex_trylock(&mpool->lock.mux) == 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (mux_lock(&mpool->lock) != 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    MPOOL_STAT_ADD(mpool, st_wait_ns, (uint64_t)((t1.tv_sec - t0.tv_sec)*1000000000LL + (t1.tv_nsec - t0.tv_nsec)));
+    return 0;
+}
+
+/**
+ * @brief   account n blocks taken out of the free list
+ * @param   mpool   memory pool
+ *          n       number of blocks
+ *
+ * @return  void
+ **/
+static void mpool_stat_take(mpool_t *mpool, size_t n)
+{
+    size_t out = MPOOL_STAT_ADD(mpool, st_out, n) + n;
+    size_t hwm = MPOOL_STAT_GET(mpool, st_hwm);
+    while (out > hwm && !__atomic_compare_exchange_n(&mpool->st_hwm, &hwm, out, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief   alloc up to n blocks with one lock round-trip
+ * @param   mpool   memory pool, not MPOOL_MODE_MALLOC
+ *          blocks  output blocks
+ *          n       number of blocks wanted
+ *
+ * @return  number of blocks got, 0 if the pool is exhausted
+ *
+ * Static pools take freed blocks first, then carve fresh ones from the buffer.
+ * DGROWN pool grows one chunk if the free list is empty.
+ **/
+static size_t mpool_get_batch(mpool_t *mpool, mpool_elm_t **blocks, size_t n)
+{
+    size_t i = 0;
+
+    if (MPOOL_LOCKFREE(mpool)) {
+        i = mpool_lf_pop(mpool, blocks, n);
+        if (i < n)
+            i += mpool_carve(mpool, blocks + i, n - i);
+        if (i > 0 && MPOOL_STATS_ON(mpool))
+            mpool_stat_take(mpool, i);
+        return i;
+    }
+
+    if (mpool_lock(mpool) != 0)
+        return 0;
+    if (TAILQ_EMPTY(&mpool->hdr_free) && mpool->mode == MPOOL_MODE_DGROWN)
+        mpool_grow(mpool);
+    for (; i<n && !TAILQ_EMPTY(&mpool->hdr_free); i++) {
+        blocks[i] = TAILQ_FIRST(&mpool->hdr_free);
+        TAILQ_REMOVE(&mpool->hdr_free, blocks[i], entry);
+    }
+    if (i < n)
+        i += mpool_carve(mpool, blocks + i, n - i);
+    if (i > 0 && MPOOL_STATS_ON(mpool))
+        mpool_stat_take(mpool, i);
+    mux_unlock(&mpool->lock);
+    return i;
+}
+
+/**
+ * @brief   free n blocks with one lock round-trip
+ * @param   mpool   memory pool, not MPOOL_MODE_MALLOC
+ *          blocks  blocks to free
+ *          n       number of blocks
+ *
+ * @return  void
+ **/
+static void mpool_put_batch(mpool_t *mpool, mpool_elm_t **blocks, size_t n)
+{
+    if (n == 0)
+        return;
+    if (MPOOL_STATS_ON(mpool))
+        MPOOL_STAT_ADD(mpool, st_out, -n);
+
+    if (MPOOL_LOCKFREE(mpool)) {
+        mpool_lf_push(mpool, blocks, n);
+        return;
+    }
+
+    if (mpool_lock(mpool) != 0)
+        return;
+    for (size_t i=0; i<n; i++) {
+        TAILQ_INSERT_TAIL(&mpool->hdr_free, blocks[i], entry);
+    }
+    mux_unlock(&mpool->lock);
+}
+
+/**
+ * @brief   thread exit, return magazine blocks to the pool
+ * @param   arg     the magazine of the exiting thread
+ * @return  void
+ **/
+static void mpool_mag_release(void *arg)
+{
+    mpool_mag_t *mag = (mpool_mag_t *)arg;
+    mpool_t *mpool = mag->mpool;
+
+    mpool_put_batch(mpool, mag->blocks, mag->count);
+    mux_lock(&mpool->lock);
+    LIST_REMOVE(mag, entry);
+    mpool->mag_hits += mag->hits;
+    mpool->mag_misses += mag->misses;
+    MPOOL_STAT_ADD(mpool, st_allocs, mag->allocs);
+    MPOOL_STAT_ADD(mpool, st_frees, mag->frees);
+    mux_unlock(&mpool->lock);
+    free(mag);
+}
+
+/**
+ * @brief   get magazine of the calling thread, create it if not exist
+ * @param   mpool   memory pool with cache enabled
+ * @return  magazine, NULL is returned on error and errno is set
+ **/
+static mpool_mag_t* mpool_mag_get(mpool_t *mpool)
+{
+    mpool_mag_t *mag = (mpool_mag_t *)pthread_getspecific(mpool->mag_key);
+    if (mag == NULL) {
+        mag = (mpool_mag_t *)malloc(sizeof(mpool_mag_t) + mpool->mag_size*sizeof(mpool_elm_t *));
+        if (mag == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        mag->mpool = mpool;
+        mag->count = 0;
+        mag->hits = 0;
+        mag->misses = 0;
+        mag->allocs = 0;
+        mag->frees = 0;
+        if ((errno = pthread_setspecific(mpool->mag_key, mag)) != 0) {
+            free(mag);
+            return NULL;
+        }
+        mux_lock(&mpool->lock);
+        LIST_INSERT_HEAD(&mpool->mags, mag, entry);
+        mux_unlock(&mpool->lock);
+    }
+    return mag;
+}
+
 /**
  * @brief   Init memory pool, do not init a mpool in use before clean it,
  *          otherwise memory leaks
@@ -29,7 +453,8 @@ extern "C" {
  * use system malloc & free, mpool does nothing
  *
  * MPOOL_MODE_DGROWN: n = 0, data_size != 0
- * malloc every element, but never free except mpool deleted
+ * malloc a chunk of elements when the pool is empty, chunks are freed when
+ * mpool deleted or released by mpool_trim() when all blocks are free
  *
  * MPOOL_MODE_ISTATIC: n != 0, data_size != 0
  * mpool once malloc/free a big pool for all n*elements
@@ -39,7 +464,43 @@ extern "C" {
  **/
 int mpool_init(mpool_t *mpool, size_t n, size_t data_size)
 {
-    if (mpool == NULL) {
+    return mpool_init_ex(mpool, n, data_size, 0);
+}
+
+/**
+ * @brief   Init memory pool with flags
+ * @param   mpool       memory poll
+ *          n           number of data element
+ *          data_size   max size of user data
+ *          flags       MPOOL_FLAG_xxx
+ *
+ * @return  0 is ok
+ *
+ * MPOOL_FLAG_LOCKFREE:
+ * ISTATIC/ESTATIC pool alloc/free blocks with a tagged-index lock-free stack
+ * instead of the mutex & free/used list, the flag is ignored in other modes.
+ * number of blocks must be less than UINT32_MAX.
+ *
+ * MPOOL_FLAG_MMAP/HUGETLB/THP/POPULATE/MLOCK:
+ * ISTATIC buffer is anonymous mmap instead of malloc, optionally on explicit
+ * (reserved hugetlbfs pages) or transparent huge pages, prefaulted and/or
+ * locked at init so that no page fault happens on the hot path.
+ * init fails if huge pages are not available or mlock is not permitted.
+ *
+ * MPOOL_FLAG_ALIGN64/ALIGN_PAGE:
+ * data of every block starts on a cache line/page boundary, block stride
+ * is padded to the same boundary in ISTATIC, ESTATIC and DGROWN mode so
+ * that neighbouring blocks never share a cache line. data is aligned to
+ * MPOOL_ALIGN_DEFAULT without the flags.
+ *
+ * MPOOL_FLAG_STATS:
+ * count allocs, frees & high-water mark of mpool_stats() on every malloc/free
+ * of a pool without magazine. costs a few relaxed atomics on a shared cache
+ * line per operation, magazines count per thread & need no flag.
+ **/
+int mpool_init_ex(mpool_t *mpool, size_t n, size_t data_size, int flags)
+{
+    if (mpool == NULL || ((flags & MPOOL_FLAG_LOCKFREE) && n >= UINT32_MAX)) {
         errno = EINVAL;
         return -1;
     }
@@ -53,18 +514,44 @@ int mpool_init(mpool_t *mpool, size_t n, size_t data_size)
             mpool->mode = MPOOL_MODE_ISTATIC;
     }
     mpool->data_size = data_size;
+    mpool->align = mpool_flags_align(flags);
+    mpool->block_size = MPOOL_BLOCK_SIZE_ALIGN(data_size, mpool->align);
+    mpool->flags = flags;
+    mpool->lf_head = 0;
+    mpool->carve = 0;
+    mpool->mag_size = 0;
+    mpool->mag_hits = 0;
+    mpool->mag_misses = 0;
+    LIST_INIT(&mpool->mags);
+    mpool->st_allocs = 0;
+    mpool->st_frees = 0;
+    mpool->st_fails = 0;
+    mpool->st_grows = 0;
+    mpool->st_wait_ns = 0;
+    mpool->st_out = 0;
+    mpool->st_hwm = 0;
 
     TAILQ_INIT(&mpool->hdr_free);
-    TAILQ_INIT(&mpool->hdr_used);
+    mpool->chunks = NULL;
+    mpool->nchunks = 0;
+    mpool->chunk_blocks = 0;
+    mpool->map_size = 0;
     if (n*data_size > 0) {
-        mpool->buffer = (char *)malloc(n*MPOOL_BLOCK_SIZE(data_size));
+        const size_t size = MPOOL_BLOCK_PAD(mpool->align) + n*mpool->block_size;
+        if (flags & MPOOL_FLAGS_MMAP) {
+            mpool->buffer = mpool_map_buffer(size, flags, &mpool->map_size);
+        } else if (posix_memalign((void **)&mpool->buffer, mpool->align, size) != 0) {
+            mpool->buffer = NULL;
+            errno = ENOMEM;
+        }
         if (mpool->buffer == NULL) 
             return -1;
-        for (size_t i=0; i<n; i++) {
-            TAILQ_INSERT_TAIL(&mpool->hdr_free, (mpool_elm_t *)(mpool->buffer + MPOOL_BLOCK_SIZE(data_size)*i), entry);
-        }
+        mpool->base = mpool->buffer + MPOOL_BLOCK_PAD(mpool->align);
+        mpool->n = n;
     } else {
         mpool->buffer = NULL;
+        mpool->base = NULL;
+        mpool->n = 0;
     }
     if (mux_init(&mpool->lock) != 0)
         return -1;
@@ -106,25 +593,35 @@ int mpool_destroy(mpool_t *mpool)
     }
     if (mux_lock(&mpool->lock) != 0)
         return -1;
-    if (mpool->mode == MPOOL_MODE_DGROWN) {
-        mpool_elm_t *p;
-        TAILQ_FOREACH(p, &mpool->hdr_free, entry) {
-            TAILQ_REMOVE(&mpool->hdr_free, p, entry);
-            free(p);
-        }
-        TAILQ_FOREACH(p, &mpool->hdr_used, entry) {
-            TAILQ_REMOVE(&mpool->hdr_used, p, entry);
-            free(p);
+    if (mpool->mag_size > 0) {
+        pthread_key_delete(mpool->mag_key);
+        while (!LIST_EMPTY(&mpool->mags)) {
+            mpool_mag_t *mag = LIST_FIRST(&mpool->mags);
+            LIST_REMOVE(mag, entry);
+            free(mag);
         }
-    } 
+        mpool->mag_size = 0;
+    }
+    for (size_t i=0; i<mpool->nchunks; i++)
+        free(mpool->chunks[i]);
+    free(mpool->chunks);
+    mpool->chunks = NULL;
+    mpool->nchunks = 0;
 
     TAILQ_INIT(&mpool->hdr_free);
-    TAILQ_INIT(&mpool->hdr_used);
     if (mpool->mode == MPOOL_MODE_ISTATIC && mpool->buffer){
-        free(mpool->buffer);
+        if (mpool->map_size > 0)
+            munmap(mpool->buffer, mpool->map_size);
+        else
+            free(mpool->buffer);
     }
+    mpool->map_size = 0;
     mpool->buffer = NULL;
+    mpool->base = NULL;
     mpool->data_size = 0;
+    mpool->n = 0;
+    mpool->lf_head = 0;
+    mpool->carve = 0;
     mpool->mode = MPOOL_MODE_DESTROY;
     mux_unlock(&mpool->lock);
 
@@ -144,6 +641,13 @@ int mpool_destroy(mpool_t *mpool)
  * mpool must be empty before mpool_setbuf called, example:
  *      mpool_init(pool, 0, 0);
  *      mpool_setbuf(...);
+ *
+ * flags given by mpool_init_ex() are kept, e.g. MPOOL_FLAG_LOCKFREE.
+ * blocks start at the first address of buf where data is aligned & the
+ * block stride is rounded up to the alignment (16, or MPOOL_FLAG_ALIGN64 /
+ * MPOOL_FLAG_ALIGN_PAGE), so n * MPOOL_BLOCK_SIZE(data_size) bytes may hold
+ * n - 1 blocks only. size the buffer with MPOOL_BUF_SIZE(n, data_size, align)
+ * to get n blocks at any address.
  **/
 int mpool_setbuf(mpool_t *mpool, char *buf, size_t buf_size, size_t data_size)
 {
@@ -153,17 +657,25 @@ int mpool_setbuf(mpool_t *mpool, char *buf, size_t buf_size, size_t data_size)
     }
     if (mux_lock(&mpool->lock) != 0)
         return -1;
-    if ((!TAILQ_EMPTY(&mpool->hdr_used)) || (!TAILQ_EMPTY(&mpool->hdr_free)) || (!mpool->buffer)) {
+    if (mpool->nchunks > 0 || (!TAILQ_EMPTY(&mpool->hdr_free)) || (mpool->buffer)) {
         mux_unlock(&mpool->lock);
         errno = EBUSY;
         return -1;
     }
-    mpool->buffer = buf;
-    size_t n = buf_size / MPOOL_BLOCK_SIZE(data_size);
-    for (size_t i=0; i<n; i++) {
-        TAILQ_INSERT_TAIL(&mpool->hdr_free, (mpool_elm_t *)(buf + MPOOL_BLOCK_SIZE(data_size)*i), entry);
+    const size_t block_size = MPOOL_BLOCK_SIZE_ALIGN(data_size, mpool->align);
+    const size_t pad = (mpool->align - ((size_t)buf + sizeof(mpool_elm_t)) % mpool->align) % mpool->align;
+    size_t n = (buf_size > pad) ? (buf_size - pad) / block_size : 0;
+    if ((mpool->flags & MPOOL_FLAG_LOCKFREE) && n >= UINT32_MAX) {
+        mux_unlock(&mpool->lock);
+        errno = EINVAL;
+        return -1;
     }
+    mpool->buffer = buf;
+    mpool->base = buf + pad;
     mpool->data_size = data_size;
+    mpool->block_size = block_size;
+    mpool->n = n;
+    mpool->carve = 0;
     mpool->mode = MPOOL_MODE_ESTATIC;
     mux_unlock(&mpool->lock);
     return 0;
@@ -185,38 +697,43 @@ void* mpool_malloc(mpool_t *mpool, size_t size)
         return NULL;
     }
 
-    if (mux_lock(&mpool->lock) != 0)
-        return NULL;
     if (mpool->mode == MPOOL_MODE_MALLOC) {
-        mux_unlock(&mpool->lock);
-        return malloc(size);
+        void *mem = malloc(size);
+        if (mem == NULL)
+            MPOOL_STAT_ADD(mpool, st_fails, 1);
+        else if (MPOOL_STATS_ON(mpool))
+            MPOOL_STAT_ADD(mpool, st_allocs, 1);
+        return mem;
     }
 
     if (size <= mpool->data_size) {
-        if (!TAILQ_EMPTY(&mpool->hdr_free)) {
-            mpool_elm_t *p = TAILQ_FIRST(&mpool->hdr_free);
-            TAILQ_REMOVE(&mpool->hdr_free, p, entry);
-            TAILQ_INSERT_TAIL(&mpool->hdr_used, p, entry);
-            mux_unlock(&mpool->lock);
+        mpool_mag_t *mag = (mpool->mag_size > 0) ? mpool_mag_get(mpool) : NULL;
+        mpool_elm_t *p;
+
+        if (mag) {
+            if (mag->count > 0) {
+                MPOOL_STAT_INC_OWNER(mag, hits);
+            } else {
+                MPOOL_STAT_INC_OWNER(mag, misses);
+                mag->count = (int)mpool_get_batch(mpool, mag->blocks, (mpool->mag_size + 1) / 2);
+            }
+            if (mag->count > 0) {
+                MPOOL_STAT_INC_OWNER(mag, allocs);
+                p = mag->blocks[--mag->count];
+                __atomic_store_n(&p->refcnt, 1, __ATOMIC_RELAXED);
+                return p->data;
+            }
+        } else if (mpool_get_batch(mpool, &p, 1) == 1) {
+            if (MPOOL_STATS_ON(mpool))
+                MPOOL_STAT_ADD(mpool, st_allocs, 1);
+            __atomic_store_n(&p->refcnt, 1, __ATOMIC_RELAXED);
             return p->data;
-        } else {
-            if (mpool->mode == MPOOL_MODE_DGROWN) {
-                mpool_elm_t *p = (mpool_elm_t *)malloc(MPOOL_BLOCK_SIZE(mpool->data_size));
-                if (p) {
-                    TAILQ_INSERT_TAIL(&mpool->hdr_used, p, entry);
-                    mux_unlock(&mpool->lock);
-                    return p->data;
-                }
-            } 
-            mux_unlock(&mpool->lock);
-            errno = ENOMEM;
-            return NULL;
         }
-    } else {
-        mux_unlock(&mpool->lock);
-        errno = ENOMEM;
-        return NULL;
     }
+
+    MPOOL_STAT_ADD(mpool, st_fails, 1);
+    errno = ENOMEM;
+    return NULL;
 }
 
 /**
@@ -231,18 +748,353 @@ void* mpool_malloc(mpool_t *mpool, size_t size)
 void mpool_free(mpool_t *mpool, void *mem)
 {
     if (mpool && mem) {
-        if (mux_lock(&mpool->lock) != 0)
-            return;
         if (mpool->mode == MPOOL_MODE_MALLOC) {
-            mux_unlock(&mpool->lock);
+            if (MPOOL_STATS_ON(mpool))
+                MPOOL_STAT_ADD(mpool, st_frees, 1);
             free(mem);
             return;
         }
+
         mpool_elm_t *p = CONTAINER_OF(mem, mpool_elm_t, data);
-        TAILQ_REMOVE(&mpool->hdr_used, p, entry);
-        TAILQ_INSERT_TAIL(&mpool->hdr_free, p, entry);
+        mpool_mag_t *mag = (mpool->mag_size > 0) ? mpool_mag_get(mpool) : NULL;
+        if (mag) {
+            if (mag->count == mpool->mag_size) {
+                const int half = mpool->mag_size / 2;
+                mpool_put_batch(mpool, mag->blocks + half, mag->count - half);
+                mag->count = half;
+            }
+            MPOOL_STAT_INC_OWNER(mag, frees);
+            mag->blocks[mag->count++] = p;
+        } else {
+            if (MPOOL_STATS_ON(mpool))
+                MPOOL_STAT_ADD(mpool, st_frees, 1);
+            mpool_put_batch(mpool, &p, 1);
+        }
+    }
+}
+
+/**
+ * @brief   add a reference to the block
+ * @param   mpool   mpool the block allocated from
+ *          mem     block's data
+ *
+ * @return  0 is ok
+ *
+ * block is allocated with one reference, every mpool_ref() needs one
+ * more mpool_unref(), e.g. one per consumer the block is handed to.
+ * not available in MPOOL_MODE_MALLOC.
+ **/
+int mpool_ref(mpool_t *mpool, void *mem)
+{
+    if (mpool == NULL || mem == NULL || mpool->mode == MPOOL_MODE_MALLOC) {
+        errno = EINVAL;
+        return -1;
+    }
+    mpool_elm_t *p = CONTAINER_OF(mem, mpool_elm_t, data);
+    __atomic_fetch_add(&p->refcnt, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * @brief   drop a reference, the last one frees the block to the pool
+ * @param   mpool   mpool the block allocated from
+ *          mem     block's data
+ *
+ * @return  references left, 0 if the block is freed. -1 returned on error.
+ **/
+int mpool_unref(mpool_t *mpool, void *mem)
+{
+    if (mpool == NULL || mem == NULL || mpool->mode == MPOOL_MODE_MALLOC) {
+        errno = EINVAL;
+        return -1;
+    }
+    mpool_elm_t *p = CONTAINER_OF(mem, mpool_elm_t, data);
+    uint32_t left = __atomic_sub_fetch(&p->refcnt, 1, __ATOMIC_ACQ_REL);
+    if (left == 0)
+        mpool_free(mpool, mem);
+    return (int)left;
+}
+
+/**
+ * @brief   alloc n blocks with one lock round-trip or one atomic splice
+ * @param   mpool   mpool to be used
+ *          size    size of each block wanted
+ *          ptrs    output, blocks' data
+ *          n       number of blocks wanted
+ *
+ * @return  number of blocks allocated, may be less than n if the pool is
+ *          short of blocks, errno is ENOMEM then. -1 returned on error.
+ *
+ * per-thread magazine is bypassed, blocks can be freed by mpool_free() or
+ * mpool_free_n() in any thread.
+ **/
+int mpool_malloc_n(mpool_t *mpool, size_t size, void **ptrs, int n)
+{
+    if (mpool == NULL || ptrs == NULL || n < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int got = 0;
+    if (mpool->mode == MPOOL_MODE_MALLOC) {
+        while (got < n && (ptrs[got] = malloc(size)) != NULL)
+            got++;
+    } else if (size <= mpool->data_size) {
+        mpool_elm_t **blocks = (mpool_elm_t **)ptrs;
+        while (got < n) {
+            size_t k = mpool_get_batch(mpool, blocks + got, n - got);
+            if (k == 0)
+                break;
+            got += (int)k;
+        }
+        for (int i=0; i<got; i++) {
+            __atomic_store_n(&blocks[i]->refcnt, 1, __ATOMIC_RELAXED);
+            ptrs[i] = blocks[i]->data;
+        }
+    }
+
+    if (MPOOL_STATS_ON(mpool))
+        MPOOL_STAT_ADD(mpool, st_allocs, got);
+    if (got < n) {
+        MPOOL_STAT_ADD(mpool, st_fails, 1);
+        errno = ENOMEM;
+    }
+    return got;
+}
+
+/**
+ * @brief   free n blocks with one lock round-trip or one atomic splice
+ * @param   mpool   mpool to be used
+ *          ptrs    blocks' data to be free, NULL is skipped, the array
+ *                  is used as scratch and its content is undefined after
+ *          n       number of blocks
+ *
+ * @return  void
+ **/
+void mpool_free_n(mpool_t *mpool, void **ptrs, int n)
+{
+    if (mpool == NULL || ptrs == NULL || n <= 0)
+        return;
+
+    if (mpool->mode == MPOOL_MODE_MALLOC) {
+        for (int i=0; i<n; i++)
+            free(ptrs[i]);
+        if (MPOOL_STATS_ON(mpool))
+            MPOOL_STAT_ADD(mpool, st_frees, n);
+        return;
+    }
+
+    mpool_elm_t **blocks = (mpool_elm_t **)ptrs;
+    int k = 0;
+    for (int i=0; i<n; i++) {
+        if (ptrs[i])
+            blocks[k++] = CONTAINER_OF(ptrs[i], mpool_elm_t, data);
+    }
+    if (MPOOL_STATS_ON(mpool))
+        MPOOL_STAT_ADD(mpool, st_frees, k);
+    mpool_put_batch(mpool, blocks, k);
+}
+
+/**
+ * @brief   set number of blocks the DGROWN pool grows each time
+ * @param   mpool   memory pool
+ *          blocks  blocks per chunk, 0 is MPOOL_CHUNK_SIZE_DEFAULT bytes
+ *
+ * @return  0 is ok
+ *
+ * chunks already grown are not changed
+ **/
+int mpool_set_chunk(mpool_t *mpool, size_t blocks)
+{
+    if (mpool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mux_lock(&mpool->lock) != 0)
+        return -1;
+    mpool->chunk_blocks = blocks;
+    mux_unlock(&mpool->lock);
+    return 0;
+}
+
+/**
+ * @brief   release DGROWN chunks whose blocks are all free
+ * @param   mpool   memory pool
+ * @return  number of chunks released, -1 is returned on error
+ *
+ * call it after a traffic burst to give memory back to the OS, blocks
+ * cached by threads (mpool_set_cache) keep their chunks. it walks the
+ * whole free list, do not call it on the hot path.
+ **/
+int mpool_trim(mpool_t *mpool)
+{
+    if (mpool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mpool->mode != MPOOL_MODE_DGROWN)
+        return 0;
+    if (mpool_lock(mpool) != 0)
+        return -1;
+
+    mpool_elm_t *p, *next;
+    for (size_t i=0; i<mpool->nchunks; i++)
+        mpool->chunks[i]->nfree = 0;
+    TAILQ_FOREACH(p, &mpool->hdr_free, entry)
+        mpool_chunk_of(mpool, p)->nfree++;
+
+    for (p = TAILQ_FIRST(&mpool->hdr_free); p != NULL; p = next) {
+        next = TAILQ_NEXT(p, entry);
+        mpool_chunk_t *c = mpool_chunk_of(mpool, p);
+        if (c->nfree == c->nblocks)
+            TAILQ_REMOVE(&mpool->hdr_free, p, entry);
+    }
+
+    int released = 0;
+    size_t k = 0;
+    for (size_t i=0; i<mpool->nchunks; i++) {
+        mpool_chunk_t *c = mpool->chunks[i];
+        if (c->nfree == c->nblocks) {
+            mpool->n -= c->nblocks;
+            free(c);
+            released++;
+        } else {
+            mpool->chunks[k++] = c;
+        }
+    }
+    mpool->nchunks = k;
+    mux_unlock(&mpool->lock);
+
+#ifdef __GLIBC__
+    if (released > 0)
+        malloc_trim(0);
+#endif
+    return released;
+}
+
+/**
+ * @brief   get statistics of the pool
+ * @param   mpool   memory pool
+ *          stats   output
+ *
+ * @return  0 is ok
+ *
+ * allocs, frees, in_use & high_water read 0 unless the pool counts them:
+ * - mpool_set_cache(): magazines count per thread, no flag needed
+ * - MPOOL_FLAG_STATS of mpool_init_ex(): relaxed atomics on a shared cache
+ *   line on every malloc/free, off by default for that cost
+ * failures, grows, lock_wait_ns & capacity are always counted.
+ *
+ * counters are relaxed, the snapshot is not atomic as a whole.
+ * high_water counts blocks cached by threads as out of the pool.
+ **/
+int mpool_stats(mpool_t *mpool, mpool_stats_t *stats)
+{
+    if (mpool == NULL || stats == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mux_lock(&mpool->lock) != 0)
+        return -1;
+    stats->allocs = MPOOL_STAT_GET(mpool, st_allocs);
+    stats->frees = MPOOL_STAT_GET(mpool, st_frees);
+    mpool_mag_t *mag;
+    LIST_FOREACH(mag, &mpool->mags, entry) {
+        stats->allocs += __atomic_load_n(&mag->allocs, __ATOMIC_RELAXED);
+        stats->frees += __atomic_load_n(&mag->frees, __ATOMIC_RELAXED);
+    }
+    stats->capacity = mpool->n;
+    mux_unlock(&mpool->lock);
+
+    stats->in_use = (stats->allocs > stats->frees) ? (size_t)(stats->allocs - stats->frees) : 0;
+    stats->high_water = MPOOL_STAT_GET(mpool, st_hwm);
+    stats->failures = MPOOL_STAT_GET(mpool, st_fails);
+    stats->grows = MPOOL_STAT_GET(mpool, st_grows);
+    stats->lock_wait_ns = MPOOL_STAT_GET(mpool, st_wait_ns);
+    return 0;
+}
+
+/**
+ * @brief   enable per-thread magazine cache in front of the pool
+ * @param   mpool       memory pool
+ *          mag_size    max number of blocks cached by each thread
+ *
+ * @return  0 is ok
+ *
+ * every thread gets a small stack of blocks, mpool_malloc/mpool_free
+ * hit the stack without lock and refill/return half of it in one batch.
+ * call it once before the pool is shared. blocks cached by a thread are
+ * returned when it exits or calls mpool_cache_flush().
+ * each cached pool uses one pthread key. MPOOL_MODE_MALLOC is not cached.
+ **/
+int mpool_set_cache(mpool_t *mpool, int mag_size)
+{
+    if (mpool == NULL || mag_size <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mux_lock(&mpool->lock) != 0)
+        return -1;
+    if (mpool->mag_size > 0) {
+        mux_unlock(&mpool->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    if ((errno = pthread_key_create(&mpool->mag_key, mpool_mag_release)) != 0) {
         mux_unlock(&mpool->lock);
+        return -1;
+    }
+    mpool->mag_size = mag_size;
+    mux_unlock(&mpool->lock);
+    return 0;
+}
+
+/**
+ * @brief   return all blocks cached by the calling thread to the pool
+ * @param   mpool   memory pool
+ * @return  void
+ **/
+void mpool_cache_flush(mpool_t *mpool)
+{
+    if (mpool && mpool->mag_size > 0) {
+        mpool_mag_t *mag = (mpool_mag_t *)pthread_getspecific(mpool->mag_key);
+        if (mag) {
+            mpool_put_batch(mpool, mag->blocks, mag->count);
+            mag->count = 0;
+        }
+    }
+}
+
+/**
+ * @brief   get magazine hit/miss counters of all threads
+ * @param   mpool   memory pool
+ *          hits    output, malloc served by magazine, can be NULL
+ *          misses  output, malloc refilled magazine from pool, can be NULL
+ *
+ * @return  0 is ok
+ **/
+int mpool_cache_stats(mpool_t *mpool, uint64_t *hits, uint64_t *misses)
+{
+    if (mpool == NULL) {
+        errno = EINVAL;
+        return -1;
     }
+    if (mux_lock(&mpool->lock) != 0)
+        return -1;
+    uint64_t h = mpool->mag_hits;
+    uint64_t m = mpool->mag_misses;
+    mpool_mag_t *mag;
+    LIST_FOREACH(mag, &mpool->mags, entry) {
+        h += __atomic_load_n(&mag->hits, __ATOMIC_RELAXED);
+        m += __atomic_load_n(&mag->misses, __ATOMIC_RELAXED);
+    }
+    mux_unlock(&mpool->lock);
+
+    if (hits)
+        *hits = h;
+    if (misses)
+        *misses = m;
+    return 0;
 }
 
 #ifdef __cplusplus
@@ -8,6 +8,7 @@
 #define __MEMORY_POOL__
 
 #include <sys/queue.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -25,26 +26,107 @@ enum {
     MPOOL_MODE_ESTATIC          /* extern memory pool, user alloc/free the static buffer */
 };
 
+/* mpool flags, see mpool_init_ex() */
+#define MPOOL_FLAG_LOCKFREE         0x0001      /* lock-free free list in ISTATIC/ESTATIC mode */
+#define MPOOL_FLAG_MMAP             0x0002      /* ISTATIC buffer from anonymous mmap */
+#define MPOOL_FLAG_HUGETLB          0x0004      /* ISTATIC buffer on explicit huge pages, implies MMAP */
+#define MPOOL_FLAG_THP              0x0008      /* ISTATIC buffer on transparent huge pages, implies MMAP */
+#define MPOOL_FLAG_POPULATE         0x0010      /* prefault ISTATIC buffer at init, implies MMAP */
+#define MPOOL_FLAG_MLOCK            0x0020      /* lock ISTATIC buffer in RAM, implies MMAP */
+#define MPOOL_FLAG_ALIGN64          0x0040      /* block data aligned to cache line, default is 16 */
+#define MPOOL_FLAG_ALIGN_PAGE       0x0080      /* block data aligned to page */
+#define MPOOL_FLAG_STATS            0x0100      /* alloc/free/in-use/high-water counters without magazine, 0 if unset, see mpool_stats() */
+
+#define MPOOL_FLAGS_MMAP            (MPOOL_FLAG_MMAP | MPOOL_FLAG_HUGETLB | MPOOL_FLAG_THP | \
+                                     MPOOL_FLAG_POPULATE | MPOOL_FLAG_MLOCK)
+
+#define MPOOL_HUGEPAGE_SIZE         (2*1024*1024)
+
+#define MPOOL_ALIGN_DEFAULT         16
+#define MPOOL_ALIGN_CACHELINE       64
+#define MPOOL_ALIGN_PAGE            4096
+
 typedef struct __mpool_elm {
-    TAILQ_ENTRY(__mpool_elm)    entry;
-    char                        data[];     /* flexible array */
+    union {
+        TAILQ_ENTRY(__mpool_elm)    entry;      /* free list link, locked modes */
+        uint32_t                    next;       /* free stack link (index + 1), lock-free mode */
+        uint32_t                    refcnt;     /* reference count while in use */
+    };
+    char                            data[];     /* flexible array */
 } mpool_elm_t;
 
 typedef TAILQ_HEAD(__mpool_head, __mpool_elm) mpool_head_t;
 
+/* DGROWN chunk of blocks, see mpool_set_chunk() */
+typedef struct __mpool_chunk mpool_chunk_t;
+
+#define MPOOL_CHUNK_SIZE_DEFAULT    (64*1024)   /* default bytes of DGROWN chunk */
+
+/* per-thread magazine, see mpool_set_cache() */
+typedef struct __mpool_mag mpool_mag_t;
+typedef LIST_HEAD(__mpool_mag_head, __mpool_mag) mpool_mag_head_t;
+
+/**
+ * pool statistics, see mpool_stats().
+ * in_use, high_water, allocs & frees read 0 unless MPOOL_FLAG_STATS is set
+ * or magazines are enabled by mpool_set_cache().
+ **/
+typedef struct {
+    size_t          capacity;       /* blocks of static buffer or grown so far */
+    size_t          in_use;         /* blocks held by user */
+    size_t          high_water;     /* max blocks out of the pool free list */
+    uint64_t        allocs;
+    uint64_t        frees;
+    uint64_t        failures;       /* malloc failed with ENOMEM */
+    uint64_t        grows;          /* DGROWN growth events */
+    uint64_t        lock_wait_ns;   /* cumulative time waiting for the pool lock */
+} mpool_stats_t;
+
 typedef struct __mpool mpool_t;
 struct __mpool {
     mpool_head_t    hdr_free;
-    mpool_head_t    hdr_used;
     mux_t           lock;
     size_t          data_size;
+    size_t          block_size;     /* block stride, padded to align */
+    size_t          align;          /* alignment of block data */
+    size_t          n;              /* number of blocks in static buffer or grown */
     char*           buffer;
+    char*           base;           /* first block in static buffer */
+    size_t          carve;          /* static blocks handed out so far, carved lazily */
+    size_t          map_size;       /* bytes mapped if ISTATIC buffer is from mmap */
+    mpool_chunk_t** chunks;         /* DGROWN chunks sorted by address */
+    size_t          nchunks;
+    size_t          chunk_blocks;   /* blocks per DGROWN chunk, 0 is default */
     int             mode;
+    int             flags;
+    uint64_t        lf_head;        /* lock-free stack top: tag(32) | index + 1(32) */
+
+    pthread_key_t   mag_key;        /* per-thread magazine */
+    int             mag_size;       /* blocks per magazine, 0 is disabled */
+    mpool_mag_head_t mags;          /* magazines of live threads */
+    uint64_t        mag_hits;       /* counters of exited threads */
+    uint64_t        mag_misses;
+
+    uint64_t        st_allocs;      /* statistics, relaxed atomic */
+    uint64_t        st_frees;
+    uint64_t        st_fails;
+    uint64_t        st_grows;
+    uint64_t        st_wait_ns;
+    size_t          st_out;         /* blocks out of the free list, include cached ones */
+    size_t          st_hwm;
 };
 
-#define MPOOL_BLOCK_SIZE(data_size)     (sizeof(mpool_elm_t) + data_size)
+/* block stride & bytes before the first block of a buffer aligned to 'align' */
+#define MPOOL_BLOCK_SIZE_ALIGN(data_size, align)    ((sizeof(mpool_elm_t) + (data_size) + (align) - 1) & ~((size_t)(align) - 1))
+#define MPOOL_BLOCK_PAD(align)                      (((align) - sizeof(mpool_elm_t) % (align)) % (align))
+
+#define MPOOL_BLOCK_SIZE(data_size)     MPOOL_BLOCK_SIZE_ALIGN(data_size, MPOOL_ALIGN_DEFAULT)
+
+/* mpool_setbuf() buffer for n blocks at any address, up to align - 1 bytes are skipped to align the first one */
+#define MPOOL_BUF_SIZE(n, data_size, align)         ((n) * MPOOL_BLOCK_SIZE_ALIGN(data_size, align) + (align) - 1)
 
 extern int          mpool_init          (mpool_t *mpool, size_t n, size_t data_size);
+extern int          mpool_init_ex       (mpool_t *mpool, size_t n, size_t data_size, int flags);
 extern mpool_t*     mpool_new           (size_t n, size_t data_size);
 extern int          mpool_destroy       (mpool_t *mpool);
 
@@ -53,6 +135,21 @@ extern int          mpool_setbuf        (mpool_t *mpool, char *buf, size_t buf_s
 extern void*        mpool_malloc        (mpool_t *mpool, size_t size);
 extern void         mpool_free          (mpool_t *mpool, void *mem);
 
+extern int          mpool_ref           (mpool_t *mpool, void *mem);
+extern int          mpool_unref         (mpool_t *mpool, void *mem);
+
+extern int          mpool_malloc_n      (mpool_t *mpool, size_t size, void **ptrs, int n);
+extern void         mpool_free_n        (mpool_t *mpool, void **ptrs, int n);
+
+extern int          mpool_set_chunk     (mpool_t *mpool, size_t blocks);
+extern int          mpool_trim          (mpool_t *mpool);
+
+extern int          mpool_stats         (mpool_t *mpool, mpool_stats_t *stats);
+
+extern int          mpool_set_cache     (mpool_t *mpool, int mag_size);
+extern void         mpool_cache_flush   (mpool_t *mpool);
+extern int          mpool_cache_stats   (mpool_t *mpool, uint64_t *hits, uint64_t *misses);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,215 @@
+/**
+ * @file    mpool.hpp
+ * @author  ln
+ * @brief   C++ allocator & std::pmr::memory_resource adapters over mpool, slab and arena (C++17)
+ *
+ * header only, link with the C objects as usual:
+ *
+ *      mpool_slab_t slab;
+ *      mpool_slab_init(&slab, NULL, 8, 0, 0);     // n = 0, classes grow on demand
+ *      mpool::slab_resource res(&slab);
+ *      std::pmr::unordered_map<int, int> map(&res);
+ *
+ * Requests the pool can not serve by size or alignment go to the upstream
+ * resource (new_delete_resource() by default), the decision only depends on
+ * (bytes, alignment) so deallocate() always returns a block to where it came
+ * from. Pool exhaustion throws std::bad_alloc.
+ **/
+
+#ifndef __MEMORY_POOL_HPP__
+#define __MEMORY_POOL_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <memory_resource>
+
+#include "mpool.h"
+#include "mpool_slab.h"
+#include "arena.h"
+
+namespace mpool {
+
+/* memory resource over one fixed block size pool */
+class pool_resource : public std::pmr::memory_resource {
+public:
+    explicit pool_resource(mpool_t *mp, std::pmr::memory_resource *upstream = std::pmr::new_delete_resource()) noexcept
+        : mp_(mp), upstream_(upstream) {}
+
+    mpool_t*                    pool() const noexcept       { return mp_; }
+    std::pmr::memory_resource*  upstream() const noexcept   { return upstream_; }
+
+protected:
+    bool fits(std::size_t bytes, std::size_t alignment) const noexcept
+    {
+        if (mp_->mode == MPOOL_MODE_MALLOC)
+            return alignment <= alignof(std::max_align_t);
+        return bytes <= mp_->data_size && alignment <= mp_->align;
+    }
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        if (!fits(bytes, alignment))
+            return upstream_->allocate(bytes, alignment);
+        void *mem = mpool_malloc(mp_, bytes);
+        if (mem == nullptr)
+            throw std::bad_alloc();
+        return mem;
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+    {
+        if (!fits(bytes, alignment))
+            upstream_->deallocate(p, bytes, alignment);
+        else
+            mpool_free(mp_, p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        auto *o = dynamic_cast<const pool_resource *>(&other);
+        return o && o->mp_ == mp_ && o->upstream_ == upstream_;
+    }
+
+private:
+    mpool_t*                    mp_;
+    std::pmr::memory_resource*  upstream_;
+};
+
+/* memory resource over the size class allocator, uses the sized free */
+class slab_resource : public std::pmr::memory_resource {
+public:
+    explicit slab_resource(mpool_slab_t *slab, std::pmr::memory_resource *upstream = std::pmr::new_delete_resource()) noexcept
+        : slab_(slab), upstream_(upstream) {}
+
+    mpool_slab_t*               slab() const noexcept       { return slab_; }
+    std::pmr::memory_resource*  upstream() const noexcept   { return upstream_; }
+
+protected:
+    int class_of(std::size_t bytes, std::size_t alignment) const noexcept
+    {
+        int idx = mpool_slab_class(slab_, bytes);
+        if (idx >= 0 && alignment > slab_->pool[idx].align)
+            return -1;
+        return idx;
+    }
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        int idx = class_of(bytes, alignment);
+        if (idx < 0)
+            return upstream_->allocate(bytes, alignment);
+        void *mem = mpool_malloc(&slab_->pool[idx], bytes);
+        if (mem == nullptr)
+            throw std::bad_alloc();
+        return mem;
+    }
+
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override
+    {
+        int idx = class_of(bytes, alignment);
+        if (idx < 0)
+            upstream_->deallocate(p, bytes, alignment);
+        else
+            mpool_free(&slab_->pool[idx], p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        auto *o = dynamic_cast<const slab_resource *>(&other);
+        return o && o->slab_ == slab_ && o->upstream_ == upstream_;
+    }
+
+private:
+    mpool_slab_t*               slab_;
+    std::pmr::memory_resource*  upstream_;
+};
+
+/* memory resource over an arena, deallocate is a no-op, memory comes back on arena_reset() */
+class arena_resource : public std::pmr::memory_resource {
+public:
+    explicit arena_resource(arena_t *arena) noexcept : arena_(arena) {}
+
+    arena_t*    arena() const noexcept  { return arena_; }
+
+protected:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        std::size_t extra = (alignment > ARENA_ALIGN) ? alignment - ARENA_ALIGN : 0;
+        void *mem = arena_malloc(arena_, bytes + extra);
+        if (mem == nullptr)
+            throw std::bad_alloc();
+        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(mem);
+        if (extra)
+            addr = (addr + alignment - 1) & ~(std::uintptr_t)(alignment - 1);
+        return reinterpret_cast<void *>(addr);
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        auto *o = dynamic_cast<const arena_resource *>(&other);
+        return o && o->arena_ == arena_;
+    }
+
+private:
+    arena_t*    arena_;
+};
+
+/**
+ * standard allocator over one pool, for containers that are not pmr aware.
+ * single objects that fit a block come from the pool, arrays & oversized
+ * types go to operator new.
+ **/
+template <typename T>
+class allocator {
+public:
+    typedef T           value_type;
+    typedef std::size_t size_type;
+
+    explicit allocator(mpool_t *mp) noexcept : mp_(mp) {}
+    template <typename U>
+    allocator(const allocator<U> &other) noexcept : mp_(other.pool()) {}
+
+    mpool_t*    pool() const noexcept   { return mp_; }
+
+    T* allocate(size_type n)
+    {
+        if (!fits(n))
+            return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+        void *mem = mpool_malloc(mp_, sizeof(T));
+        if (mem == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T *>(mem);
+    }
+
+    void deallocate(T *p, size_type n) noexcept
+    {
+        if (!fits(n))
+            ::operator delete(p, std::align_val_t(alignof(T)));
+        else
+            mpool_free(mp_, p);
+    }
+
+    template <typename U>
+    bool operator==(const allocator<U> &other) const noexcept { return mp_ == other.pool(); }
+    template <typename U>
+    bool operator!=(const allocator<U> &other) const noexcept { return mp_ != other.pool(); }
+
+private:
+    bool fits(size_type n) const noexcept
+    {
+        if (n != 1)
+            return false;
+        if (mp_->mode == MPOOL_MODE_MALLOC)
+            return alignof(T) <= alignof(std::max_align_t);
+        return sizeof(T) <= mp_->data_size && alignof(T) <= mp_->align;
+    }
+
+    mpool_t*    mp_;
+};
+
+}
+
+#endif
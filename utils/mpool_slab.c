@@ -0,0 +1,160 @@
+/**
+ * @file    mpool_slab.c
+ * @author  ln
+ * @brief   multi size class memory pool
+ **/
+
+#include "mpool_slab.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief   init slab, one mpool for each size class
+ * @param   slab        slab to init
+ *          sizes       max data size of each class in ascending order,
+ *                      NULL is power-of-two classes from MPOOL_SLAB_MIN_SIZE
+ *          nclass      number of size classes, <= MPOOL_SLAB_MAX_CLASS
+ *          n           number of blocks of each class, 0 is dynamic grown
+ *          flags       MPOOL_FLAG_xxx of each class pool
+ *
+ * @return  0 is ok
+ *
+ * example: 16, 32, ... 4096 bytes, 1024 blocks each
+ *      mpool_slab_init(slab, NULL, 9, 1024, 0);
+ **/
+int mpool_slab_init(mpool_slab_t *slab, const size_t *sizes, int nclass, size_t n, int flags)
+{
+    if (slab == NULL || nclass <= 0 || nclass > MPOOL_SLAB_MAX_CLASS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i=0; i<nclass; i++) {
+        slab->size[i] = sizes ? sizes[i] : ((size_t)MPOOL_SLAB_MIN_SIZE << i);
+        if (slab->size[i] == 0 || (i > 0 && slab->size[i] <= slab->size[i-1])) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    slab->shift = sizes ? -1 : __builtin_ctzl(MPOOL_SLAB_MIN_SIZE);
+
+    for (int i=0; i<nclass; i++) {
+        if (mpool_init_ex(&slab->pool[i], n, slab->size[i], flags) != 0) {
+            const int err = errno;
+            while (--i >= 0)
+                mpool_destroy(&slab->pool[i]);
+            errno = err;
+            return -1;
+        }
+    }
+    slab->nclass = nclass;
+    return 0;
+}
+
+/**
+ * @brief   create slab
+ * @param   sizes       max data size of each class, NULL is power-of-two
+ *          nclass      number of size classes
+ *          n           number of blocks of each class
+ *          flags       MPOOL_FLAG_xxx
+ *
+ * @return  pointer to the slab created
+ **/
+mpool_slab_t* mpool_slab_new(const size_t *sizes, int nclass, size_t n, int flags)
+{
+    mpool_slab_t *slab = (mpool_slab_t *)malloc(sizeof(mpool_slab_t));
+    if (slab && (mpool_slab_init(slab, sizes, nclass, n, flags) != 0)) {
+        free(slab);
+        slab = NULL;
+    }
+    return slab;
+}
+
+/**
+ * @brief   destroy all class pools of the slab
+ * @param   slab    slab to be cleaned
+ * @return  0 is ok
+ **/
+int mpool_slab_destroy(mpool_slab_t *slab)
+{
+    if (slab == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i=0; i<slab->nclass; i++)
+        mpool_destroy(&slab->pool[i]);
+    slab->nclass = 0;
+    return 0;
+}
+
+/**
+ * @brief   get size class of the size
+ * @param   slab    slab
+ *          size    size of block wanted
+ *
+ * @return  index of the smallest class fits the size, -1 if too large
+ **/
+int mpool_slab_class(mpool_slab_t *slab, size_t size)
+{
+    if (slab->shift >= 0) {
+        int idx = 0;
+        if (size > ((size_t)1 << slab->shift))
+            idx = (int)(sizeof(long)*8) - __builtin_clzl(size - 1) - slab->shift;
+        return (idx < slab->nclass) ? idx : -1;
+    }
+
+    int lo = 0, hi = slab->nclass;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (slab->size[mid] < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo < slab->nclass) ? lo : -1;
+}
+
+/**
+ * @brief   alloc memory block from the smallest class fits the size
+ * @param   slab    slab to be used
+ *          size    size of block wanted
+ *
+ * @return  block's data field, NULL is returned and errno is ENOMEM if
+ *          the size is larger than the largest class or the class is exhausted
+ **/
+void* mpool_slab_malloc(mpool_slab_t *slab, size_t size)
+{
+    if (slab == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int idx = mpool_slab_class(slab, size);
+    if (idx < 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return mpool_malloc(&slab->pool[idx], size);
+}
+
+/**
+ * @brief   free memory block to its class
+ * @param   slab    slab to be used
+ *          mem     block's data to be free
+ *          size    the same size given to mpool_slab_malloc()
+ *
+ * @return  void
+ **/
+void mpool_slab_free(mpool_slab_t *slab, void *mem, size_t size)
+{
+    if (slab && mem) {
+        int idx = mpool_slab_class(slab, size);
+        if (idx >= 0)
+            mpool_free(&slab->pool[idx], mem);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
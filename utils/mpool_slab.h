@@ -0,0 +1,39 @@
+/**
+ * @file    mpool_slab.h
+ * @author  ln
+ * @brief   multi size class memory pool
+ **/
+
+#ifndef __MEMORY_POOL_SLAB__
+#define __MEMORY_POOL_SLAB__
+
+#include "mpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MPOOL_SLAB_MAX_CLASS            32
+#define MPOOL_SLAB_MIN_SIZE             16      /* smallest power-of-two class */
+
+/* one mpool per size class, classes are sorted by size */
+typedef struct {
+    int             nclass;
+    int             shift;          /* log2 of the smallest power-of-two class, -1 if custom classes */
+    size_t          size[MPOOL_SLAB_MAX_CLASS];
+    mpool_t         pool[MPOOL_SLAB_MAX_CLASS];
+} mpool_slab_t;
+
+extern int              mpool_slab_init     (mpool_slab_t *slab, const size_t *sizes, int nclass, size_t n, int flags);
+extern mpool_slab_t*    mpool_slab_new      (const size_t *sizes, int nclass, size_t n, int flags);
+extern int              mpool_slab_destroy  (mpool_slab_t *slab);
+
+extern int              mpool_slab_class    (mpool_slab_t *slab, size_t size);
+extern void*            mpool_slab_malloc   (mpool_slab_t *slab, size_t size);
+extern void             mpool_slab_free     (mpool_slab_t *slab, void *mem, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
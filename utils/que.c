@@ -19,6 +19,35 @@
 extern "C" {
 #endif
 
+/**
+ * @brief   alloc element from slab or mpool of the que
+ * @param   que     queue
+ *          len     user data length
+ *
+ * @return  element allocated
+ **/
+static que_elm_t* que_elm_alloc(que_cb_t *que, int len)
+{
+    if (que->slab)
+        return (que_elm_t*)mpool_slab_malloc(que->slab, sizeof(que_elm_t) + len);
+    return (que_elm_t*)mpool_malloc(&que->mpool, sizeof(que_elm_t) + len);
+}
+
+/**
+ * @brief   free element to slab or mpool of the que
+ * @param   que     queue
+ *          elm     element to free
+ *
+ * @return  void
+ **/
+static void que_elm_free(que_cb_t *que, que_elm_t *elm)
+{
+    if (que->slab)
+        mpool_slab_free(que->slab, elm, sizeof(que_elm_t) + elm->len);
+    else
+        mpool_free(&que->mpool, elm);
+}
+
 /**
  * @brief   init que control block
  * @param   que        queue to be init
@@ -35,6 +64,7 @@ int que_init(que_cb_t *que)
     mux_init(&que->lock);
     que->count      = 0;
     que->max_size   = QUE_MAX_SIZE_DEFAULT;
+    que->slab       = NULL;
     if (mpool_init(&que->mpool, 0, 0) != 0)
         return -1;
 
@@ -88,6 +118,29 @@ int que_set_mpool(que_cb_t *que, size_t n, size_t data_size)
     return 0;
 }
 
+/**
+ * @brief   alloc elements from the slab instead of que's own mpool
+ * @param   que     queue
+ *          slab    slab shared by any number of queues, NULL to use own mpool
+ *
+ * @return  0 is ok. -1 returned with EBUSY if que is not empty.
+ *
+ * slab must outlive the que, and it's not destroyed by que_destroy()
+ **/
+int que_set_slab(que_cb_t *que, mpool_slab_t *slab)
+{
+    if (mux_lock(&que->lock) < 0)
+        return -1;
+    if (!QUE_EMPTY(que)) {
+        mux_unlock(&que->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    que->slab = slab;
+    mux_unlock(&que->lock);
+    return 0;
+}
+
 /**
  * @brief   set max size of que
  * @param   que         queue
@@ -160,7 +213,7 @@ int que_insert_head(que_cb_t *que, void *data, int len)
     }
 
     /* memoy allocate */
-    que_elm_t *elm = (que_elm_t*)mpool_malloc(&que->mpool, (sizeof(que_elm_t) + len));
+    que_elm_t *elm = que_elm_alloc(que, len);
     if (elm == 0) {
         mux_unlock(&que->lock);
         errno = ENOMEM;
@@ -201,7 +254,7 @@ int que_insert_tail(que_cb_t *que, void *data, int len)
         return -1;
     }
 
-    que_elm_t *elm = (que_elm_t*)mpool_malloc(&que->mpool, (sizeof(que_elm_t) + len));
+    que_elm_t *elm = que_elm_alloc(que, len);
     if (elm == 0) {
         mux_unlock(&que->lock);
         errno = EAGAIN;
@@ -241,7 +294,7 @@ int QUE_INSERT_AFTER(que_cb_t *que, que_elm_t *list_elm, void *data, int len)
         return -1;
     }
 
-    que_elm_t *elm = (que_elm_t*)mpool_malloc(&que->mpool, (sizeof(que_elm_t) + len));
+    que_elm_t *elm = que_elm_alloc(que, len);
     if (elm == 0) {
         errno = ENOMEM;
         return -1;
@@ -277,7 +330,7 @@ int QUE_INSERT_BEFORE(que_cb_t *que, que_elm_t *list_elm, void *data, int len)
         return -1;
     }
 
-    que_elm_t *elm = (que_elm_t*)mpool_malloc(&que->mpool, (sizeof(que_elm_t) + len));
+    que_elm_t *elm = que_elm_alloc(que, len);
     if (elm == 0) {
         errno = ENOMEM;
         return -1;
@@ -325,7 +378,7 @@ int QUE_REMOVE(que_cb_t *que, que_elm_t *elm)
         return -1;
     }
     TAILQ_REMOVE(&que->head, elm, entry);
-    mpool_free(&que->mpool, elm);
+    que_elm_free(que, elm);
     if (que->count > 0) {
         que->count--;
     }
@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <pthread.h>
 #include "mpool.h"
+#include "mpool_slab.h"
 #include "mux.h"
 
 #ifdef __cplusplus
@@ -56,6 +57,7 @@ typedef int     (*que_cmp_data_t)(const void*, const void*, size_t len);
 /* thread safe queue control block */
 typedef struct {
     mpool_t             mpool;
+    mpool_slab_t*       slab;           /* elements alloc from slab if not NULL */
 
     que_head_t          head;           /* list header */
     mux_t               lock;           /* data lock */
@@ -102,6 +104,7 @@ extern void         que_destroy         (que_cb_t *que);
 
 extern int          que_set_maxsize     (que_cb_t *que, int max_size);
 extern int          que_set_mpool       (que_cb_t *que, size_t n, size_t data_size);
+extern int          que_set_slab        (que_cb_t *que, mpool_slab_t *slab);
 
 extern int          que_empty           (que_cb_t *que);
 extern int          que_count           (que_cb_t *que);
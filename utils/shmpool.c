@@ -0,0 +1,266 @@
+/**
+ * @file    shmpool.c
+ * @author  ln
+ * @brief   process shared memory pool
+ **/
+
+#include "shmpool.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHMPOOL_INDEX(head)                 ((uint32_t)(head))
+#define SHMPOOL_TAG(head)                   ((uint32_t)((head) >> 32))
+#define SHMPOOL_MAKE(tag, index)            (((uint64_t)(tag) << 32) | (uint64_t)(index))
+
+/* free block keeps the index of the next free block in its first 4 bytes */
+#define SHMPOOL_NEXT(pool, index)           ((uint32_t *)((pool)->base + (pool)->hdr->block_size*((index) - 1)))
+
+/**
+ * @brief   map shared memory & make the local handle
+ * @param   fd      shared memory object
+ *          name    name of the object
+ *          size    bytes to map
+ *
+ * @return  handle, NULL is returned on error and errno is set
+ **/
+static shmpool_t* shmpool_map(int fd, const char *name, size_t size)
+{
+    shmpool_t *pool = (shmpool_t *)malloc(sizeof(shmpool_t));
+    if (pool == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        free(pool);
+        return NULL;
+    }
+    pool->hdr = (shmpool_hdr_t *)p;
+    pool->base = NULL;
+    pool->map_size = size;
+    strncpy(pool->name, name, SHMPOOL_NAME_MAX - 1);
+    pool->name[SHMPOOL_NAME_MAX - 1] = '\0';
+    return pool;
+}
+
+/**
+ * @brief   create a pool in a new shared memory object
+ * @param   name        shm_open() name, e.g. "/serial_frames"
+ *          n           number of blocks, < UINT32_MAX
+ *          data_size   max size of user data
+ *
+ * @return  handle of the pool, NULL is returned on error and errno is set
+ *
+ * EEXIST is returned if the name is in use, shmpool_unlink() it first.
+ **/
+shmpool_t* shmpool_create(const char *name, size_t n, size_t data_size)
+{
+    if (name == NULL || n == 0 || n >= UINT32_MAX || data_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const size_t block_size = (data_size + SHMPOOL_ALIGN - 1) & ~((size_t)SHMPOOL_ALIGN - 1);
+    const size_t offset = (sizeof(shmpool_hdr_t) + SHMPOOL_ALIGN - 1) & ~((size_t)SHMPOOL_ALIGN - 1);
+    const size_t size = offset + n * block_size;
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, (off_t)size) != 0) {
+        const int err = errno;
+        close(fd);
+        shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+    shmpool_t *pool = shmpool_map(fd, name, size);
+    close(fd);
+    if (pool == NULL) {
+        const int err = errno;
+        shm_unlink(name);
+        errno = err;
+        return NULL;
+    }
+
+    shmpool_hdr_t *hdr = pool->hdr;
+    hdr->n = n;
+    hdr->data_size = data_size;
+    hdr->block_size = block_size;
+    hdr->offset = offset;
+    hdr->attached = 1;
+    pool->base = (char *)hdr + offset;
+    for (size_t i=1; i<=n; i++) {
+        *SHMPOOL_NEXT(pool, i) = (i < n) ? (uint32_t)(i+1) : 0;
+    }
+    hdr->head = SHMPOOL_MAKE(0, 1);
+    __atomic_store_n(&hdr->magic, SHMPOOL_MAGIC, __ATOMIC_RELEASE);
+    return pool;
+}
+
+/**
+ * @brief   attach to a pool created by another process
+ * @param   name    name given to shmpool_create()
+ * @return  handle of the pool, NULL is returned on error and errno is set
+ *
+ * EAGAIN is returned if the creator has not finished init yet
+ **/
+shmpool_t* shmpool_attach(const char *name)
+{
+    if (name == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(shmpool_hdr_t)) {
+        close(fd);
+        errno = EAGAIN;
+        return NULL;
+    }
+    shmpool_t *pool = shmpool_map(fd, name, (size_t)st.st_size);
+    close(fd);
+    if (pool == NULL)
+        return NULL;
+
+    if (__atomic_load_n(&pool->hdr->magic, __ATOMIC_ACQUIRE) != SHMPOOL_MAGIC) {
+        munmap(pool->hdr, pool->map_size);
+        free(pool);
+        errno = EAGAIN;
+        return NULL;
+    }
+    pool->base = (char *)pool->hdr + pool->hdr->offset;
+    __atomic_fetch_add(&pool->hdr->attached, 1, __ATOMIC_RELAXED);
+    return pool;
+}
+
+/**
+ * @brief   detach from the pool & free the handle
+ * @param   pool    handle from shmpool_create() or shmpool_attach()
+ * @return  0 is ok
+ *
+ * shared memory persists until shmpool_unlink() and the last detach.
+ * blocks held by this process are not returned to the pool.
+ **/
+int shmpool_detach(shmpool_t *pool)
+{
+    if (pool == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    __atomic_fetch_sub(&pool->hdr->attached, 1, __ATOMIC_RELAXED);
+    munmap(pool->hdr, pool->map_size);
+    free(pool);
+    return 0;
+}
+
+/**
+ * @brief   remove the name of the shared memory object
+ * @param   name    name given to shmpool_create()
+ * @return  0 is ok
+ **/
+int shmpool_unlink(const char *name)
+{
+    if (name == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    return shm_unlink(name);
+}
+
+/**
+ * @brief   alloc block from shared pool, lock-free
+ * @param   pool    pool handle
+ *          size    size wanted, <= data_size
+ *
+ * @return  block's data, NULL is returned and errno is ENOMEM if exhausted
+ **/
+void* shmpool_malloc(shmpool_t *pool, size_t size)
+{
+    if (pool == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    shmpool_hdr_t *hdr = pool->hdr;
+    if (size > hdr->data_size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+    uint64_t top;
+    uint32_t index;
+    do {
+        index = SHMPOOL_INDEX(head);
+        if (index == 0 || index > hdr->n) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        top = SHMPOOL_MAKE(SHMPOOL_TAG(head) + 1, __atomic_load_n(SHMPOOL_NEXT(pool, index), __ATOMIC_RELAXED));
+    } while (!__atomic_compare_exchange_n(&hdr->head, &head, top, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return SHMPOOL_NEXT(pool, index);
+}
+
+/**
+ * @brief   free block to shared pool, lock-free
+ * @param   pool    pool handle of any attached process
+ *          mem     block's data
+ *
+ * @return  void
+ **/
+void shmpool_free(shmpool_t *pool, void *mem)
+{
+    if (pool && mem) {
+        shmpool_hdr_t *hdr = pool->hdr;
+        const uint32_t index = (uint32_t)(((char *)mem - pool->base) / hdr->block_size) + 1;
+        uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_RELAXED);
+        uint64_t top;
+
+        do {
+            __atomic_store_n((uint32_t *)mem, SHMPOOL_INDEX(head), __ATOMIC_RELAXED);
+            top = SHMPOOL_MAKE(SHMPOOL_TAG(head) + 1, index);
+        } while (!__atomic_compare_exchange_n(&hdr->head, &head, top, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+}
+
+/**
+ * @brief   get offset of a block, pass it to other processes instead of pointer
+ * @param   pool    pool handle
+ *          mem     block's data
+ *
+ * @return  offset from the start of shared memory
+ **/
+uint64_t shmpool_offset(shmpool_t *pool, const void *mem)
+{
+    return (uint64_t)((const char *)mem - (const char *)pool->hdr);
+}
+
+/**
+ * @brief   get block's data in this process from an offset
+ * @param   pool    pool handle
+ *          offset  value from shmpool_offset() of any process
+ *
+ * @return  block's data, NULL if offset is out of the pool
+ **/
+void* shmpool_ptr(shmpool_t *pool, uint64_t offset)
+{
+    if (offset < pool->hdr->offset || offset >= pool->map_size)
+        return NULL;
+    return (char *)pool->hdr + offset;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,62 @@
+/**
+ * @file    shmpool.h
+ * @author  ln
+ * @brief   process shared memory pool
+ **/
+
+#ifndef __SHM_MEMORY_POOL__
+#define __SHM_MEMORY_POOL__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHMPOOL_MAGIC           0x4c4f4f50u     /* "POOL" */
+#define SHMPOOL_ALIGN           64              /* block stride & data alignment */
+#define SHMPOOL_NAME_MAX        256
+
+/**
+ * pool header at the start of the shared memory, blocks follow it.
+ * free blocks are linked by index (offset based), the free list is a
+ * lock-free stack so no lock is shared between processes.
+ **/
+typedef struct {
+    uint32_t        magic;          /* set after the pool is ready */
+    uint32_t        attached;       /* number of processes attached */
+    uint64_t        n;              /* number of blocks */
+    uint64_t        data_size;
+    uint64_t        block_size;     /* block stride */
+    uint64_t        offset;         /* first block from the start of shared memory */
+    char            pad[SHMPOOL_ALIGN - 40];
+    uint64_t        head;           /* lock-free stack top: tag(32) | index + 1(32) */
+} shmpool_hdr_t;
+
+/* process local handle of a shared pool */
+typedef struct {
+    shmpool_hdr_t*  hdr;
+    char*           base;           /* first block in this process */
+    size_t          map_size;
+    char            name[SHMPOOL_NAME_MAX];
+} shmpool_t;
+
+extern shmpool_t*   shmpool_create      (const char *name, size_t n, size_t data_size);
+extern shmpool_t*   shmpool_attach      (const char *name);
+extern int          shmpool_detach      (shmpool_t *pool);
+extern int          shmpool_unlink      (const char *name);
+
+extern void*        shmpool_malloc      (shmpool_t *pool, size_t size);
+extern void         shmpool_free        (shmpool_t *pool, void *mem);
+
+extern uint64_t     shmpool_offset      (shmpool_t *pool, const void *mem);
+extern void*        shmpool_ptr         (shmpool_t *pool, uint64_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
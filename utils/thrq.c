@@ -12,15 +12,190 @@
 #include <time.h>
 #include <pthread.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sched.h>
 #include <tgmath.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define THRQ_EMPTY(thrq)        TAILQ_EMPTY(&thrq->head)
-#define THRQ_FIRST(thrq)        TAILQ_FIRST(&thrq->head)
+#define THRQ_EMPTY(thrq)        TAILQ_EMPTY(thrq_list_top(thrq))
+#define THRQ_FIRST(thrq)        TAILQ_FIRST(thrq_list_top(thrq))
+
+#define THRQ_SLOT(ring, i)      ((thrq_slot_t *)((ring)->slots + (ring)->stride * ((i) & (ring)->mask)))
+#define THRQ_SLOT_OF(data)      ((thrq_slot_t *)((char *)(data) - offsetof(thrq_slot_t, data)))
+#define THRQ_ELM_OF(data)       ((thrq_elm_t *)((char *)(data) - offsetof(thrq_elm_t, data)))
+
+struct __thrq_sel {
+    LIST_ENTRY(__thrq_sel)  entry;
+    uint32_t*               seq;        /* futex of the selecting thread */
+};
+
+static uint64_t thrq_sel_clock = 0;     /* thrq_select() stamps, see sel_stamp */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define THRQ_PAUSE()            __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define THRQ_PAUSE()            __asm__ __volatile__("yield" ::: "memory")
+#else
+#define THRQ_PAUSE()            __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/**
+ * @brief   list to pop from, the highest non-empty priority level
+ * @param   thrq    queue
+ * @return  list head, thrq->head (empty) if all levels are empty
+ **/
+static inline thrq_head_t* thrq_list_top(thrq_cb_t *thrq)
+{
+    if (thrq->level == NULL || thrq->level_mask == 0)
+        return &thrq->head;
+    return &thrq->level[31 - __builtin_clz(thrq->level_mask)].head;
+}
+
+/**
+ * @brief   append element to the list of its priority level, lock held
+ * @param   thrq    queue
+ *          elm     element, elm->prio is the level
+ *
+ * @return  void
+ **/
+static inline void thrq_list_link(thrq_cb_t *thrq, thrq_elm_t *elm)
+{
+    if (thrq->level == NULL) {
+        TAILQ_INSERT_TAIL(&thrq->head, elm, entry);
+        return;
+    }
+    thrq_level_t *lvl = &thrq->level[elm->prio];
+    TAILQ_INSERT_TAIL(&lvl->head, elm, entry);
+    lvl->count++;
+    thrq->level_mask |= 1u << elm->prio;
+}
+
+/**
+ * @brief   unlink element from the list of its priority level, lock held
+ * @param   thrq    queue
+ *          elm     element
+ *
+ * @return  void
+ **/
+static inline void thrq_list_unlink(thrq_cb_t *thrq, thrq_elm_t *elm)
+{
+    if (thrq->level == NULL) {
+        TAILQ_REMOVE(&thrq->head, elm, entry);
+        return;
+    }
+    thrq_level_t *lvl = &thrq->level[elm->prio];
+    TAILQ_REMOVE(&lvl->head, elm, entry);
+    if (--lvl->count == 0)
+        thrq->level_mask &= ~(1u << elm->prio);
+}
+
+/**
+ * @brief   number of elements that still fit a priority level, lock held
+ * @param   thrq    queue
+ *          prio    priority level
+ *
+ * @return  room, <= 0 is full
+ **/
+static inline int thrq_list_room(thrq_cb_t *thrq, int prio)
+{
+    int room = thrq->max_size - thrq->count;
+    if (thrq->level) {
+        thrq_level_t *lvl = &thrq->level[prio];
+        if (lvl->max_size - lvl->count < room)
+            room = lvl->max_size - lvl->count;
+    }
+    return room;
+}
+
+/**
+ * @brief   keep the eventfd readable while the list is not empty, lock held
+ * @param   thrq    queue
+ * @return  void
+ *
+ * called after every count change, it only touches the fd on the empty
+ * to non-empty transition & back.
+ **/
+static inline void thrq_efd_sync(thrq_cb_t *thrq)
+{
+    if (thrq->efd < 0)
+        return;
+
+    int ready = (thrq->count > 0);
+    if (ready != thrq->efd_ready) {
+        uint64_t v = 1;
+        ssize_t r = ready ? write(thrq->efd, &v, sizeof(v)) : read(thrq->efd, &v, sizeof(v));
+        (void)r;
+        thrq->efd_ready = ready;
+    }
+}
+
+/**
+ * @brief   alloc element from slab or mpool of the thrq
+ * @param   thrq    queue
+ *          len     user data length
+ *
+ * @return  element allocated
+ **/
+static thrq_elm_t* thrq_elm_alloc(thrq_cb_t *thrq, int len)
+{
+    thrq_elm_t *elm;
+    if (thrq->slab)
+        elm = (thrq_elm_t*)mpool_slab_malloc(thrq->slab, sizeof(thrq_elm_t) + len);
+    else
+        elm = (thrq_elm_t*)mpool_malloc(&thrq->mpool, sizeof(thrq_elm_t) + len);
+    if (elm)
+        elm->prio = 0;
+    return elm;
+}
+
+/**
+ * @brief   free element to slab or mpool of the thrq
+ * @param   thrq    queue
+ *          elm     element to free
+ *
+ * @return  void
+ **/
+static void thrq_elm_free(thrq_cb_t *thrq, thrq_elm_t *elm)
+{
+    if (thrq->slab)
+        mpool_slab_free(thrq->slab, elm, sizeof(thrq_elm_t) + elm->len);
+    else
+        mpool_free(&thrq->mpool, elm);
+}
+
+/**
+ * @brief   wake senders parked in thrq_send_timed() after elements are taken
+ * @param   thrq    queue
+ *          n       number of elements taken, > 1 wakes all senders
+ *
+ * @return  void
+ *
+ * list mode calls it with the lock held. ring modes pair the fence with
+ * thrq_ring_wait_room(), like thrq_notify() does for receivers.
+ **/
+static void thrq_room_notify(thrq_cb_t *thrq, int n)
+{
+    if (thrq->mode != THRQ_MODE_LIST)
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (n > 0 && __atomic_load_n(&thrq->full_waiters, __ATOMIC_RELAXED) > 0) {
+        mux_lock(&thrq->lock);
+        if (n > 1)
+            pthread_cond_broadcast(&thrq->cond_notfull);
+        else
+            pthread_cond_signal(&thrq->cond_notfull);
+        mux_unlock(&thrq->lock);
+    }
+}
 
 /**
  * @brief   init thrq control block
@@ -43,9 +218,27 @@ int thrq_init(thrq_cb_t *thrq)
         return -1;
     if ((errno = pthread_cond_init(&thrq->cond, &thrq->cond_attr) != 0)) 
         return -1;
+    if ((errno = pthread_cond_init(&thrq->cond_notfull, &thrq->cond_attr) != 0)) 
+        return -1;
 
     thrq->count     = 0;
     thrq->max_size  = THRQ_MAX_SIZE_DEFAULT;
+    thrq->slab      = NULL;
+    thrq->mode      = THRQ_MODE_LIST;
+    thrq->ring      = NULL;
+    thrq->waiters   = 0;
+    thrq->full_waiters = 0;
+    thrq->levels    = 1;
+    thrq->efd       = -1;
+    thrq->efd_ready = 0;
+    thrq->wait_mode = THRQ_WAIT_COND;
+    thrq->spin      = THRQ_SPIN_DEFAULT;
+    thrq->futex     = 0;
+    LIST_INIT(&thrq->sel);
+    thrq->nsel      = 0;
+    thrq->sel_stamp = 0;
+    thrq->level_mask = 0;
+    thrq->level     = NULL;
 
     if (mpool_init(&thrq->mpool, 0, 0) != 0)
         return -1;
@@ -90,11 +283,13 @@ static int thrq_remove(thrq_cb_t *thrq, thrq_elm_t *elm)
     if (thrq != 0 && elm != 0) {
         if (mux_lock(&thrq->lock) < 0)
             return -1;
-        TAILQ_REMOVE(&thrq->head, elm, entry);
-        mpool_free(&thrq->mpool, elm);
+        thrq_list_unlink(thrq, elm);
+        thrq_elm_free(thrq, elm);
         if (thrq->count > 0) {
-            thrq->count--;
+            __atomic_sub_fetch(&thrq->count, 1, __ATOMIC_RELAXED);
         }
+        thrq_efd_sync(thrq);
+        thrq_room_notify(thrq, 1);
         mux_unlock(&thrq->lock);
     }
     return 0;
@@ -111,10 +306,20 @@ void thrq_destroy(thrq_cb_t *thrq)
         if (mux_lock(&thrq->lock) != 0)
             return;
         pthread_cond_destroy(&thrq->cond);
+        pthread_cond_destroy(&thrq->cond_notfull);
         pthread_condattr_destroy(&thrq->cond_attr);
         while (!THRQ_EMPTY(thrq)) {
             thrq_remove(thrq, THRQ_FIRST(thrq));
         }    
+        free(thrq->ring);
+        thrq->ring = NULL;
+        thrq->mode = THRQ_MODE_LIST;
+        free(thrq->level);
+        thrq->level = NULL;
+        thrq->levels = 1;
+        if (thrq->efd >= 0)
+            close(thrq->efd);
+        thrq->efd = -1;
         mux_unlock(&thrq->lock);
 
         mux_destroy(&thrq->lock);
@@ -143,6 +348,323 @@ int thrq_set_mpool(thrq_cb_t *thrq, size_t n, size_t data_size)
     return 0;
 }
 
+/**
+ * @brief   alloc elements from the slab instead of thrq's own mpool
+ * @param   thrq    queue
+ *          slab    slab shared by any number of queues, NULL to use own mpool
+ *
+ * @return  0 is ok. -1 returned with EBUSY if thrq is not empty.
+ *
+ * slab must outlive the thrq, and it's not destroyed by thrq_destroy()
+ **/
+int thrq_set_slab(thrq_cb_t *thrq, mpool_slab_t *slab)
+{
+    if (mux_lock(&thrq->lock) < 0)
+        return -1;
+    if (!THRQ_EMPTY(thrq)) {
+        mux_unlock(&thrq->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    thrq->slab = slab;
+    mux_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   number of elements in the ring
+ * @param   ring    ring of the queue
+ * @return  count
+ **/
+static size_t thrq_ring_count(thrq_ring_t *ring)
+{
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) - head;
+}
+
+/**
+ * @brief   number of messages in the ring, slots discarded by thrq_commit() excluded
+ * @param   ring    ring of the queue
+ * @return  count
+ **/
+static size_t thrq_ring_msgs(thrq_ring_t *ring)
+{
+    size_t count = thrq_ring_count(ring);
+    size_t holes = __atomic_load_n(&ring->holes, __ATOMIC_SEQ_CST);
+    return (count > holes) ? count - holes : 0;
+}
+
+/**
+ * @brief   max number of elements in the ring, the smaller of capacity & max_size
+ * @param   thrq    queue in ring mode
+ * @return  limit
+ **/
+static inline size_t thrq_ring_limit(thrq_cb_t *thrq)
+{
+    size_t limit = thrq->ring->mask + 1;
+    if (thrq->max_size >= 0 && (size_t)thrq->max_size < limit)
+        limit = (size_t)thrq->max_size;
+    return limit;
+}
+
+/**
+ * @brief   switch the storage of thrq between list & lock-free ring
+ * @param   thrq        queue
+ *          mode        THRQ_MODE_LIST, THRQ_MODE_SPSC or THRQ_MODE_MPMC
+ *          capacity    number of slots, rounded up to power of 2 (ring modes)
+ *          slot_size   max user data of one element (ring modes)
+ *
+ * @return  0 is ok. -1 returned with EBUSY if thrq is not empty, EINVAL if args are invalid.
+ *
+ * SPSC: exactly one thread sends & one thread receives. send never locks or allocs,
+ * receive only locks to park when the ring is empty. thrq_send() fails with EAGAIN
+ * when capacity or max_size elements are queued.
+ *
+ * MPMC: sequence numbered slots (Vyukov's bounded queue), producers & consumers
+ * claim slots by CAS on tail & head. same semantics as SPSC for full & empty.
+ **/
+int thrq_set_ring(thrq_cb_t *thrq, int mode, size_t capacity, size_t slot_size)
+{
+    thrq_ring_t *ring = NULL;
+
+    if (thrq == NULL || mode < THRQ_MODE_LIST || mode > THRQ_MODE_MPMC) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mode != THRQ_MODE_LIST) {
+        if (capacity == 0 || capacity > ((size_t)1 << 30) || slot_size == 0 || slot_size > INT_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        size_t cap = 2;
+        while (cap < capacity)
+            cap <<= 1;
+        size_t stride = (sizeof(thrq_slot_t) + slot_size + 7) & ~(size_t)7;
+        if (posix_memalign((void **)&ring, THRQ_CACHELINE, sizeof(thrq_ring_t) + stride * cap) != 0) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(ring, 0, sizeof(thrq_ring_t));
+        ring->mask = cap - 1;
+        ring->slot_size = slot_size;
+        ring->stride = stride;
+        for (size_t i=0; i<cap; i++)
+            THRQ_SLOT(ring, i)->seq = i;
+    }
+
+    if (mux_lock(&thrq->lock) < 0) {
+        free(ring);
+        return -1;
+    }
+    if (mode != THRQ_MODE_LIST && (thrq->levels > 1 || thrq->efd >= 0)) {
+        mux_unlock(&thrq->lock);
+        free(ring);
+        errno = EINVAL;
+        return -1;
+    }
+    if (!THRQ_EMPTY(thrq) || (thrq->ring && thrq_ring_count(thrq->ring) > 0)) {
+        mux_unlock(&thrq->lock);
+        free(ring);
+        errno = EBUSY;
+        return -1;
+    }
+    free(thrq->ring);
+    thrq->ring = ring;
+    thrq->mode = mode;
+    mux_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   split the list into priority levels
+ * @param   thrq    queue in list mode
+ *          levels  number of levels 1 ~ THRQ_PRIO_MAX, 1 is plain FIFO
+ *
+ * @return  0 is ok. -1 returned with EBUSY if thrq is not empty, EINVAL if
+ *          levels is out of range or thrq is in a ring mode.
+ *
+ * receivers always get the oldest message of the highest non-empty level,
+ * found with one bit scan. thrq_send() & co. send at level 0 (the lowest),
+ * use thrq_send_prio() for the others. every level is limited by max_size
+ * of the queue and its own max size, see thrq_set_level_maxsize().
+ **/
+int thrq_set_prio(thrq_cb_t *thrq, int levels)
+{
+    thrq_level_t *level = NULL;
+
+    if (thrq == NULL || levels < 1 || levels > THRQ_PRIO_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (levels > 1) {
+        if ((level = (thrq_level_t *)malloc(sizeof(thrq_level_t) * levels)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        for (int i=0; i<levels; i++) {
+            TAILQ_INIT(&level[i].head);
+            level[i].count = 0;
+            level[i].max_size = INT_MAX;
+        }
+    }
+
+    if (mux_lock(&thrq->lock) < 0) {
+        free(level);
+        return -1;
+    }
+    if (thrq->mode != THRQ_MODE_LIST || !THRQ_EMPTY(thrq)) {
+        const int err = (thrq->mode != THRQ_MODE_LIST) ? EINVAL : EBUSY;
+        mux_unlock(&thrq->lock);
+        free(level);
+        errno = err;
+        return -1;
+    }
+    free(thrq->level);
+    thrq->level = level;
+    thrq->levels = levels;
+    thrq->level_mask = 0;
+    mux_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   set max size of one priority level
+ * @param   thrq        queue
+ *          level       priority level
+ *          max_size    max elements of the level, the queue's max_size applies as well
+ *
+ * @return  0 is ok. -1 returned with EINVAL if the level does not exist.
+ **/
+int thrq_set_level_maxsize(thrq_cb_t *thrq, int level, int max_size)
+{
+    if (mux_lock(&thrq->lock) != 0)
+        return -1;
+    if (thrq->level == NULL || level < 0 || level >= thrq->levels) {
+        mux_unlock(&thrq->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    thrq->level[level].max_size = max_size;
+    pthread_cond_broadcast(&thrq->cond_notfull);
+    mux_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   get count of one priority level
+ * @param   thrq    queue
+ *          level   priority level
+ *
+ * @return  elements count of the level, -1 with EINVAL if the level does not exist
+ **/
+int thrq_level_count(thrq_cb_t *thrq, int level)
+{
+    if (mux_lock(&thrq->lock) < 0)
+        return -1;
+    int count;
+    if (thrq->level == NULL)
+        count = (level == 0) ? thrq->count : -1;
+    else
+        count = (level >= 0 && level < thrq->levels) ? thrq->level[level].count : -1;
+    mux_unlock(&thrq->lock);
+
+    if (count < 0)
+        errno = EINVAL;
+    return count;
+}
+
+/**
+ * @brief   signal an eventfd while the queue is not empty, for epoll/poll
+ * @param   thrq    queue in list mode
+ *          enable  !0 creates the eventfd, 0 closes it
+ *
+ * @return  0 is ok. -1 returned with EINVAL if thrq is in a ring mode, errno of eventfd().
+ *
+ * the fd is readable exactly while the queue is not empty: it's written on
+ * the empty to non-empty transition & read back when the last element is
+ * taken. wait for POLLIN on thrq_fd(), then thrq_receive() / thrq_receive_n()
+ * do not block (one consumer). never read the fd yourself.
+ **/
+int thrq_set_eventfd(thrq_cb_t *thrq, int enable)
+{
+    if (thrq == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mux_lock(&thrq->lock) < 0)
+        return -1;
+    if (thrq->mode != THRQ_MODE_LIST) {
+        mux_unlock(&thrq->lock);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (enable && thrq->efd < 0) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            const int err = errno;
+            mux_unlock(&thrq->lock);
+            errno = err;
+            return -1;
+        }
+        thrq->efd = fd;
+        thrq->efd_ready = 0;
+        thrq_efd_sync(thrq);
+    } else if (!enable && thrq->efd >= 0) {
+        close(thrq->efd);
+        thrq->efd = -1;
+    }
+    mux_unlock(&thrq->lock);
+    return 0;
+}
+
+/**
+ * @brief   get the eventfd of thrq
+ * @param   thrq    queue
+ * @return  fd to poll for POLLIN, -1 with EINVAL if thrq_set_eventfd() is not enabled
+ **/
+int thrq_fd(thrq_cb_t *thrq)
+{
+    if (thrq == NULL || thrq->efd < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return thrq->efd;
+}
+
+/**
+ * @brief   set how receivers wait on an empty queue
+ * @param   thrq    queue
+ *          mode    THRQ_WAIT_COND (default) or THRQ_WAIT_SPIN
+ *          spin    pause loops before parking on the futex, THRQ_WAIT_SPIN only.
+ *                  < 0 is THRQ_SPIN_DEFAULT, 0 parks at once
+ *
+ * @return  0 is ok. -1 returned with EINVAL, EBUSY if a receiver is waiting.
+ *
+ * THRQ_WAIT_SPIN trades cpu for wakeup latency: a receiver that finds the
+ * queue empty spins on the count for a while before it sleeps, and senders
+ * wake it with one futex call instead of lock + signal. either way senders
+ * skip the wakeup when no receiver is waiting. set it before the queue is shared.
+ **/
+int thrq_set_wait(thrq_cb_t *thrq, int mode, int spin)
+{
+    if (thrq == NULL || (mode != THRQ_WAIT_COND && mode != THRQ_WAIT_SPIN)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (mux_lock(&thrq->lock) < 0)
+        return -1;
+    if (__atomic_load_n(&thrq->waiters, __ATOMIC_SEQ_CST) > 0) {
+        mux_unlock(&thrq->lock);
+        errno = EBUSY;
+        return -1;
+    }
+    thrq->wait_mode = mode;
+    thrq->spin      = (spin < 0) ? THRQ_SPIN_DEFAULT : spin;
+    mux_unlock(&thrq->lock);
+    return 0;
+}
+
 /**
  * @brief   set max size of thrq
  * @param   thrq        queue
@@ -155,6 +677,7 @@ int thrq_set_maxsize(thrq_cb_t *thrq, int max_size)
     if (mux_lock(&thrq->lock) != 0)
         return -1;
     thrq->max_size = max_size;
+    pthread_cond_broadcast(&thrq->cond_notfull);
     mux_unlock(&thrq->lock);
     return 0;
 }
@@ -166,6 +689,8 @@ int thrq_set_maxsize(thrq_cb_t *thrq, int max_size)
  **/
 int thrq_empty(thrq_cb_t *thrq)
 {
+    if (thrq->mode != THRQ_MODE_LIST)
+        return thrq_ring_msgs(thrq->ring) == 0;
     if (mux_lock(&thrq->lock) < 0)
         return 1;   // true
     int empty = THRQ_EMPTY(thrq);
@@ -181,6 +706,8 @@ int thrq_empty(thrq_cb_t *thrq)
  **/
 int thrq_count(thrq_cb_t *thrq)
 {
+    if (thrq->mode != THRQ_MODE_LIST)
+        return (int)thrq_ring_msgs(thrq->ring);
     if (mux_lock(&thrq->lock) < 0)
         return -1;
     int count = thrq->count;
@@ -194,10 +721,11 @@ int thrq_count(thrq_cb_t *thrq)
  * @param   thrq    queue to be insert
  *          data    the data to insert
  *          len     data length
+ *          prio    priority level
  *
  * @return  0 is ok
  **/
-static int thrq_insert_tail(thrq_cb_t *thrq, void *data, int len)
+static int thrq_insert_tail(thrq_cb_t *thrq, void *data, int len, int prio)
 {
     if (data == 0 || len == 0) {
         errno = EINVAL;
@@ -208,13 +736,13 @@ static int thrq_insert_tail(thrq_cb_t *thrq, void *data, int len)
     if (mux_lock(&thrq->lock) < 0)
         return -1;
 
-    if (thrq->count >= thrq->max_size) {
+    if (thrq_list_room(thrq, prio) <= 0) {
         mux_unlock(&thrq->lock);
         errno = EAGAIN;
         return -1;
     }
 
-    thrq_elm_t *elm = (thrq_elm_t*)mpool_malloc(&thrq->mpool, (sizeof(thrq_elm_t) + len));
+    thrq_elm_t *elm = thrq_elm_alloc(thrq, len);
     if (elm == 0) {
         mux_unlock(&thrq->lock);
         errno = ENOMEM;
@@ -222,8 +750,10 @@ static int thrq_insert_tail(thrq_cb_t *thrq, void *data, int len)
     }
     memcpy(elm->data, data, len);
     elm->len = len;
-    TAILQ_INSERT_TAIL(&thrq->head, elm, entry);
-    thrq->count++;
+    elm->prio = prio;
+    thrq_list_link(thrq, elm);
+    __atomic_add_fetch(&thrq->count, 1, __ATOMIC_RELAXED);
+    thrq_efd_sync(thrq);
 
     mux_unlock(&thrq->lock);
 
@@ -231,35 +761,919 @@ static int thrq_insert_tail(thrq_cb_t *thrq, void *data, int len)
 }
 
 /**
- * @brief   insert element and send signal
- * @param   thrq    queue to be send
- *          data    the data to send
- *          len     data length
+ * @brief   convert relative timeout to CLOCK_MONOTONIC deadline
+ * @param   timeout     seconds
+ *          ts          deadline
  *
- * @return  0 is ok
+ * @return  void
  **/
-int thrq_send(thrq_cb_t *thrq, void *data, int len)
+static void thrq_deadline(double timeout, struct timespec *ts)
 {
-    if (mux_lock(&thrq->lock) < 0)
-        return -1;
-    if (thrq_insert_tail(thrq, data, len) != 0) {
-        mux_unlock(&thrq->lock);
-        return -1;
-    }
-    mux_unlock(&thrq->lock);
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_nsec = (long)((timeout - (long)timeout) * 1000000000L) + ts->tv_nsec;  // ok, max_long_int = 2.1s > (1s + 1s)
+    ts->tv_sec = (time_t)timeout + ts->tv_sec + (ts->tv_nsec / 1000000000L);
+    ts->tv_nsec = ts->tv_nsec % 1000000000L;
+}
 
-    if (pthread_cond_signal(&thrq->cond) != 0) {
-        return -1;
-    }
-    return 0;
+/**
+ * @brief   deadline set by thrq_deadline() has passed
+ * @param   ts      deadline, NULL is no timeout
+ * @return  true(!0) or false(0)
+ **/
+static int thrq_expired(const struct timespec *ts)
+{
+    struct timespec now;
+
+    if (ts == NULL)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec > ts->tv_sec) || (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
 }
 
 /**
- * @brief   receive and remove element
- * @param   thrq        queue to receive
- *          buf         the data buf
- *          max_size    buf size
- *          timeout     thread block time, 0 is block until signal received
+ * @brief   wake receivers parked on an empty queue, no-op if none is parked
+ * @param   thrq    queue
+ *          n       number of messages published, > 1 wakes all receivers
+ * @return  void
+ *
+ * called after the messages are visible (list: after the lock is released).
+ * the fence pairs with the waiters increment in thrq_list_wait(), thrq_ring_wait(),
+ * thrq_park() & thrq_select(): either the receiver sees the new data, or we see it waiting.
+ **/
+static void thrq_notify(thrq_cb_t *thrq, int n)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&thrq->waiters, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    if (__atomic_load_n(&thrq->nsel, __ATOMIC_RELAXED) > 0) {
+        thrq_sel_t *sel;
+        mux_lock(&thrq->lock);
+        LIST_FOREACH(sel, &thrq->sel, entry) {
+            __atomic_add_fetch(sel->seq, 1, __ATOMIC_RELEASE);
+            syscall(SYS_futex, sel->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+        }
+        mux_unlock(&thrq->lock);
+    }
+
+    if (thrq->wait_mode == THRQ_WAIT_SPIN) {
+        __atomic_add_fetch(&thrq->futex, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &thrq->futex, FUTEX_WAKE_PRIVATE, (n > 1) ? INT_MAX : 1, NULL, NULL, 0);
+        return;
+    }
+    mux_lock(&thrq->lock);
+    if (n > 1)
+        pthread_cond_broadcast(&thrq->cond);
+    else
+        pthread_cond_signal(&thrq->cond);
+    mux_unlock(&thrq->lock);
+}
+
+/* hole at pos taken by CAS on head, the slot is free for the next lap */
+static inline void thrq_mpmc_skip(thrq_cb_t *thrq, thrq_slot_t *slot, size_t pos)
+{
+    __atomic_sub_fetch(&thrq->ring->holes, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->seq, pos + thrq->ring->mask + 1, __ATOMIC_RELEASE);
+    thrq_room_notify(thrq, 1);
+}
+
+/**
+ * @brief   MPMC: a published message is at head, holes in front of it are skipped
+ * @param   thrq    queue in MPMC mode
+ * @return  true(!0) or false(0)
+ *
+ * slots claimed but not committed yet don't count, thrq_commit() notifies
+ * when they are published.
+ **/
+static int thrq_mpmc_ready(thrq_cb_t *thrq)
+{
+    thrq_ring_t *ring = thrq->ring;
+
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    for (;;) {
+        thrq_slot_t *slot = THRQ_SLOT(ring, pos);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) != pos + 1)
+            return 0;
+        int len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);     /* taken meanwhile */
+            continue;
+        }
+        if (len >= 0)
+            return 1;
+        if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            thrq_mpmc_skip(thrq, slot, pos);
+            pos++;
+        }
+    }
+}
+
+/**
+ * @brief   queue has data, without the lock
+ * @param   thrq    queue
+ * @return  true(!0) or false(0)
+ **/
+static inline int thrq_has_data(thrq_cb_t *thrq)
+{
+    if (thrq->mode == THRQ_MODE_LIST)
+        return __atomic_load_n(&thrq->count, __ATOMIC_SEQ_CST) > 0;
+    if (thrq->mode == THRQ_MODE_MPMC)
+        return thrq_mpmc_ready(thrq);
+    return thrq_ring_count(thrq->ring) > 0;
+}
+
+/**
+ * @brief   THRQ_WAIT_SPIN: spin for data, then sleep on the futex
+ * @param   thrq    queue
+ *          ts      CLOCK_MONOTONIC deadline, NULL is no timeout
+ *
+ * @return  0 is ok (may be spurious, caller retries), -1 with errno (ETIMEDOUT)
+ **/
+static int thrq_park(thrq_cb_t *thrq, const struct timespec *ts)
+{
+    int res = 0;
+
+    /* data seen but not taken (MPMC slot not filled yet), the caller loops on us */
+    if (thrq_expired(ts)) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    for (int i=0; i<thrq->spin; i++) {
+        if (thrq_has_data(thrq))
+            return 0;
+        THRQ_PAUSE();
+    }
+
+    uint32_t seq = __atomic_load_n(&thrq->futex, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&thrq->waiters, 1, __ATOMIC_SEQ_CST);
+    if (!thrq_has_data(thrq)) {
+        /* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline */
+        if (syscall(SYS_futex, &thrq->futex, FUTEX_WAIT_BITSET_PRIVATE, seq, ts, NULL, FUTEX_BITSET_MATCH_ANY) != 0 &&
+                errno == ETIMEDOUT)
+            res = ETIMEDOUT;
+    }
+    __atomic_sub_fetch(&thrq->waiters, 1, __ATOMIC_RELAXED);
+
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   wait until the list is not empty, lock held
+ * @param   thrq    queue in list mode
+ *          ts      deadline, NULL is no timeout
+ *
+ * @return  0 is ok with count > 0, or error number (ETIMEDOUT). the lock is held either way.
+ **/
+static int thrq_list_wait(thrq_cb_t *thrq, const struct timespec *ts)
+{
+    int res = 0;
+
+    while (res == 0 && thrq->count == 0) {
+        if (thrq->wait_mode == THRQ_WAIT_SPIN) {
+            mux_unlock(&thrq->lock);
+            res = (thrq_park(thrq, ts) != 0) ? errno : 0;
+            mux_lock(&thrq->lock);
+        } else {
+            __atomic_add_fetch(&thrq->waiters, 1, __ATOMIC_SEQ_CST);
+            if (ts)
+                res = pthread_cond_timedwait(&thrq->cond, &thrq->lock.mux, ts);
+            else
+                res = pthread_cond_wait(&thrq->cond, &thrq->lock.mux);
+            __atomic_sub_fetch(&thrq->waiters, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return res;
+}
+
+/**
+ * @brief   park the receiver until the ring is not empty
+ * @param   thrq    queue
+ *          ts      deadline, NULL is no timeout
+ *
+ * @return  0 is ok (may be spurious, caller retries), -1 with errno (ETIMEDOUT)
+ **/
+static int thrq_ring_wait(thrq_cb_t *thrq, const struct timespec *ts)
+{
+    int res = 0;
+
+    if (thrq->wait_mode == THRQ_WAIT_SPIN)
+        return thrq_park(thrq, ts);
+    if (mux_lock(&thrq->lock) != 0)
+        return -1;
+    __atomic_add_fetch(&thrq->waiters, 1, __ATOMIC_SEQ_CST);
+    int empty = !thrq_has_data(thrq);
+    if (empty) {
+        if (ts)
+            res = pthread_cond_timedwait(&thrq->cond, &thrq->lock.mux, ts);
+        else
+            res = pthread_cond_wait(&thrq->cond, &thrq->lock.mux);
+    }
+    __atomic_sub_fetch(&thrq->waiters, 1, __ATOMIC_RELAXED);
+    mux_unlock(&thrq->lock);
+
+    /* MPMC: published slot taken by another receiver meanwhile */
+    if (!empty) {
+        sched_yield();
+        if (thrq_expired(ts))
+            res = ETIMEDOUT;
+    }
+
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   ring has no room for the next message
+ * @param   thrq    queue in ring mode
+ * @return  true(!0) or false(0)
+ *
+ * MPMC: a slot of the previous lap still held by thrq_peek() or a slow
+ * consumer blocks the tail too, it's given back through thrq_room_notify().
+ **/
+static int thrq_ring_full(thrq_cb_t *thrq)
+{
+    thrq_ring_t *ring = thrq->ring;
+
+    if (thrq_ring_count(ring) >= thrq_ring_limit(thrq))
+        return 1;
+    if (thrq->mode == THRQ_MODE_MPMC) {
+        size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+        return (intptr_t)(__atomic_load_n(&THRQ_SLOT(ring, pos)->seq, __ATOMIC_SEQ_CST) - pos) < 0;
+    }
+    return 0;
+}
+
+/**
+ * @brief   park the sender until the ring has room
+ * @param   thrq    queue
+ *          ts      deadline, NULL is no timeout
+ *
+ * @return  0 is ok (may be spurious, caller retries), -1 with errno (ETIMEDOUT)
+ **/
+static int thrq_ring_wait_room(thrq_cb_t *thrq, const struct timespec *ts)
+{
+    int res = 0;
+
+    if (mux_lock(&thrq->lock) != 0)
+        return -1;
+    __atomic_add_fetch(&thrq->full_waiters, 1, __ATOMIC_SEQ_CST);
+    int full = thrq_ring_full(thrq);
+    if (full) {
+        if (ts)
+            res = pthread_cond_timedwait(&thrq->cond_notfull, &thrq->lock.mux, ts);
+        else
+            res = pthread_cond_wait(&thrq->cond_notfull, &thrq->lock.mux);
+    }
+    __atomic_sub_fetch(&thrq->full_waiters, 1, __ATOMIC_RELAXED);
+    mux_unlock(&thrq->lock);
+
+    /* MPMC: lost the free slot to another producer */
+    if (!full) {
+        sched_yield();
+        if (thrq_expired(ts))
+            res = ETIMEDOUT;
+    }
+
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   copy data to the next free slot of SPSC ring
+ * @param   thrq    queue
+ *          data    the data to send
+ *          len     data length
+ *
+ * @return  0 is ok, -1 with EAGAIN if full, EINVAL if len > slot_size
+ **/
+static int thrq_spsc_send(thrq_cb_t *thrq, const void *data, int len)
+{
+    thrq_ring_t *ring = thrq->ring;
+    size_t tail = ring->tail;
+    size_t limit = thrq_ring_limit(thrq);
+
+    if ((size_t)len > ring->slot_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (tail - ring->head_cache >= limit) {
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->head_cache >= limit) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    thrq_slot_t *slot = THRQ_SLOT(ring, tail);
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    thrq_notify(thrq, 1);
+    return 0;
+}
+
+/**
+ * @brief   take up to n oldest slots of SPSC ring, park while empty
+ * @param   thrq    queue
+ *          iov     buffers, iov_len is set to the bytes copied
+ *          n       number of buffers
+ *          ts      deadline, NULL is no timeout
+ *
+ * @return  number of messages received, -1 with errno (ETIMEDOUT)
+ *
+ * head is published once for the whole batch.
+ **/
+static int thrq_spsc_receive_n(thrq_cb_t *thrq, struct iovec *iov, int n, const struct timespec *ts)
+{
+    thrq_ring_t *ring = thrq->ring;
+    size_t head = ring->head;
+
+    while (head == ring->tail_cache) {
+        ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head != ring->tail_cache)
+            break;
+        if (thrq_ring_wait(thrq, ts) != 0)
+            return -1;
+    }
+
+    int i;
+    for (i=0; i<n && head != ring->tail_cache; i++, head++) {
+        thrq_slot_t *slot = THRQ_SLOT(ring, head);
+        size_t len = (iov[i].iov_len < (size_t)slot->len) ? iov[i].iov_len : (size_t)slot->len;
+        memcpy(iov[i].iov_base, slot->data, len);
+        iov[i].iov_len = len;
+    }
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+    thrq_room_notify(thrq, i);
+    return i;
+}
+
+/**
+ * @brief   claim the next free slot of MPMC ring by CAS on tail
+ * @param   thrq    queue
+ *          pos     output ring position of the slot
+ *
+ * @return  slot claimed, NULL with EAGAIN if full
+ **/
+static thrq_slot_t* thrq_mpmc_claim(thrq_cb_t *thrq, size_t *pos)
+{
+    thrq_ring_t *ring = thrq->ring;
+    size_t limit = thrq_ring_limit(thrq);
+
+    size_t p = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        intptr_t used = (intptr_t)(p - __atomic_load_n(&ring->head, __ATOMIC_RELAXED));
+        if (used < 0) {
+            p = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);       /* consumers passed a stale tail */
+            continue;
+        }
+        if ((size_t)used >= limit) {
+            errno = EAGAIN;
+            return NULL;
+        }
+        thrq_slot_t *slot = THRQ_SLOT(ring, p);
+        intptr_t dif = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t)p;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &p, p + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *pos = p;
+                return slot;
+            }
+        } else if (dif < 0) {
+            errno = EAGAIN;         /* slot of the previous lap is not consumed yet */
+            return NULL;
+        } else {
+            p = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief   claim a slot of MPMC ring and fill it
+ * @param   thrq    queue
+ *          data    the data to send
+ *          len     data length
+ *
+ * @return  0 is ok, -1 with EAGAIN if full, EINVAL if len > slot_size
+ **/
+static int thrq_mpmc_send(thrq_cb_t *thrq, const void *data, int len)
+{
+    size_t pos;
+
+    if ((size_t)len > thrq->ring->slot_size) {
+        errno = EINVAL;
+        return -1;
+    }
+    thrq_slot_t *slot = thrq_mpmc_claim(thrq, &pos);
+    if (slot == NULL)
+        return -1;
+
+    memcpy(slot->data, data, len);
+    __atomic_store_n(&slot->len, len, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    thrq_notify(thrq, 1);
+    return 0;
+}
+
+/**
+ * @brief   number of messages a batch may send
+ * @param   n       messages in the batch
+ *          room    free slots
+ *          flags   THRQ_SEND_ALL or THRQ_SEND_PARTIAL
+ *
+ * @return  messages to send, 0 if none (errno is EAGAIN)
+ **/
+static int thrq_batch_accept(int n, size_t room, int flags)
+{
+    if ((size_t)n <= room)
+        return n;
+    if (!(flags & THRQ_SEND_PARTIAL) || room == 0) {
+        errno = EAGAIN;
+        return 0;
+    }
+    return (int)room;
+}
+
+/**
+ * @brief   copy a batch to SPSC ring, tail is published once
+ * @param   thrq    queue
+ *          iov     messages
+ *          n       number of messages, each len <= slot_size
+ *          flags   THRQ_SEND_ALL or THRQ_SEND_PARTIAL
+ *
+ * @return  number of messages sent, -1 with EAGAIN if none
+ **/
+static int thrq_spsc_send_n(thrq_cb_t *thrq, const struct iovec *iov, int n, int flags)
+{
+    thrq_ring_t *ring = thrq->ring;
+    size_t tail = ring->tail;
+    size_t limit = thrq_ring_limit(thrq);
+
+    if (tail - ring->head_cache + n > limit)
+        ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t used = tail - ring->head_cache;
+    int k = thrq_batch_accept(n, (used < limit) ? limit - used : 0, flags);
+    if (k == 0)
+        return -1;
+
+    for (int i=0; i<k; i++) {
+        thrq_slot_t *slot = THRQ_SLOT(ring, tail + i);
+        memcpy(slot->data, iov[i].iov_base, iov[i].iov_len);
+        slot->len = (int)iov[i].iov_len;
+    }
+    __atomic_store_n(&ring->tail, tail + k, __ATOMIC_RELEASE);
+
+    thrq_notify(thrq, k);
+    return k;
+}
+
+/**
+ * @brief   claim consecutive slots of MPMC ring with one CAS and fill them
+ * @param   thrq    queue
+ *          iov     messages
+ *          n       number of messages, each len <= slot_size
+ *          flags   THRQ_SEND_ALL or THRQ_SEND_PARTIAL
+ *
+ * @return  number of messages sent, -1 with EAGAIN if none
+ *
+ * the batch is contiguous in the ring, so it's never interleaved with other producers.
+ **/
+static int thrq_mpmc_send_n(thrq_cb_t *thrq, const struct iovec *iov, int n, int flags)
+{
+    thrq_ring_t *ring = thrq->ring;
+    size_t limit = thrq_ring_limit(thrq);
+    int k;
+
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        size_t used = pos - __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        size_t room = (used < limit) ? limit - used : 0;
+        size_t nfree = 0;
+
+        /* slots of the previous lap must be consumed */
+        while (nfree < room && nfree < (size_t)n) {
+            thrq_slot_t *slot = THRQ_SLOT(ring, pos + nfree);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + nfree)
+                break;
+            nfree++;
+        }
+        if (nfree == 0 && __atomic_load_n(&THRQ_SLOT(ring, pos)->seq, __ATOMIC_ACQUIRE) > pos) {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);     /* other producer moved on */
+            continue;
+        }
+        if ((k = thrq_batch_accept(n, nfree, flags)) == 0)
+            return -1;
+        if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + k, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+    }
+
+    for (int i=0; i<k; i++) {
+        thrq_slot_t *slot = THRQ_SLOT(ring, pos + i);
+        memcpy(slot->data, iov[i].iov_base, iov[i].iov_len);
+        __atomic_store_n(&slot->len, (int)iov[i].iov_len, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+
+    thrq_notify(thrq, k);
+    return k;
+}
+
+/**
+ * @brief   claim the oldest filled slot of MPMC ring by CAS on head
+ * @param   thrq    queue
+ *
+ * @return  slot taken, give it back with thrq_mpmc_put(). NULL with EAGAIN if empty
+ *
+ * slots discarded by thrq_commit() (len < 0) are skipped.
+ **/
+static thrq_slot_t* thrq_mpmc_take(thrq_cb_t *thrq)
+{
+    thrq_ring_t *ring = thrq->ring;
+
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        thrq_slot_t *slot = THRQ_SLOT(ring, pos);
+        intptr_t dif = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                if (slot->len >= 0)
+                    return slot;
+                thrq_mpmc_skip(thrq, slot, pos);
+                pos++;
+            }
+        } else if (dif < 0) {
+            errno = EAGAIN;
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* slot taken by thrq_mpmc_take() is free for the next lap */
+static inline void thrq_mpmc_put(thrq_ring_t *ring, thrq_slot_t *slot)
+{
+    __atomic_store_n(&slot->seq, slot->seq + ring->mask, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief   take the oldest message of MPMC ring
+ * @param   thrq    queue
+ *          iov     buffer, iov_len is set to the bytes copied
+ *
+ * @return  0 is ok, -1 with EAGAIN if empty
+ **/
+static int thrq_mpmc_pop(thrq_cb_t *thrq, struct iovec *iov)
+{
+    thrq_slot_t *slot = thrq_mpmc_take(thrq);
+    if (slot == NULL)
+        return -1;
+
+    size_t len = (iov->iov_len < (size_t)slot->len) ? iov->iov_len : (size_t)slot->len;
+    memcpy(iov->iov_base, slot->data, len);
+    iov->iov_len = len;
+    thrq_mpmc_put(thrq->ring, slot);
+    return 0;
+}
+
+/**
+ * @brief   take up to n messages from MPMC ring, park while empty
+ * @param   thrq    queue
+ *          iov     buffers, iov_len is set to the bytes copied
+ *          n       number of buffers
+ *          ts      deadline, NULL is no timeout
+ *
+ * @return  number of messages received, -1 with errno (ETIMEDOUT)
+ **/
+static int thrq_mpmc_receive_n(thrq_cb_t *thrq, struct iovec *iov, int n, const struct timespec *ts)
+{
+    while (thrq_mpmc_pop(thrq, &iov[0]) != 0) {
+        if (thrq_ring_wait(thrq, ts) != 0)
+            return -1;
+    }
+
+    int i = 1;
+    while (i < n && thrq_mpmc_pop(thrq, &iov[i]) == 0)
+        i++;
+
+    thrq_room_notify(thrq, i);
+    return i;
+}
+
+/**
+ * @brief   take up to n messages from the list under one lock, wait once while empty
+ * @param   thrq    queue
+ *          iov     buffers, iov_len is set to the bytes copied
+ *          n       number of buffers
+ *          ts      deadline, NULL is no timeout
+ *
+ * @return  number of messages received, -1 with errno (ETIMEDOUT)
+ *
+ * elements are unlinked under the lock, copied & freed after it's released.
+ **/
+static int thrq_list_receive_n(thrq_cb_t *thrq, struct iovec *iov, int n, const struct timespec *ts)
+{
+    thrq_head_t batch = TAILQ_HEAD_INITIALIZER(batch);
+    int res = 0;
+    int i;
+
+    if (mux_lock(&thrq->lock) != 0)
+        return -1;
+    res = thrq_list_wait(thrq, ts);
+    if (res != 0) {
+        mux_unlock(&thrq->lock);
+        errno = res;
+        return -1;    // errno may be ETIMEDOUT
+    }
+    for (i=0; i<n && !THRQ_EMPTY(thrq); i++) {
+        thrq_elm_t *elm = THRQ_FIRST(thrq);
+        thrq_list_unlink(thrq, elm);
+        TAILQ_INSERT_TAIL(&batch, elm, entry);
+        __atomic_sub_fetch(&thrq->count, 1, __ATOMIC_RELAXED);
+    }
+    thrq_efd_sync(thrq);
+    thrq_room_notify(thrq, i);
+    mux_unlock(&thrq->lock);
+
+    i = 0;
+    while (!TAILQ_EMPTY(&batch)) {
+        thrq_elm_t *elm = TAILQ_FIRST(&batch);
+        size_t len = (iov[i].iov_len < (size_t)elm->len) ? iov[i].iov_len : (size_t)elm->len;
+        memcpy(iov[i].iov_base, elm->data, len);
+        iov[i].iov_len = len;
+        TAILQ_REMOVE(&batch, elm, entry);
+        thrq_elm_free(thrq, elm);
+        i++;
+    }
+    return i;
+}
+
+/**
+ * @brief   insert element and send signal
+ * @param   thrq    queue to be send
+ *          data    the data to send
+ *          len     data length
+ *
+ * @return  0 is ok
+ **/
+int thrq_send(thrq_cb_t *thrq, void *data, int len)
+{
+    if (thrq->mode != THRQ_MODE_LIST) {
+        if (data == 0 || len <= 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (thrq->mode == THRQ_MODE_SPSC)
+            return thrq_spsc_send(thrq, data, len);
+        return thrq_mpmc_send(thrq, data, len);
+    }
+
+    if (mux_lock(&thrq->lock) < 0)
+        return -1;
+    if (thrq_insert_tail(thrq, data, len, 0) != 0) {
+        const int err = errno;
+        mux_unlock(&thrq->lock);
+        errno = err;
+        return -1;
+    }
+    mux_unlock(&thrq->lock);
+
+    thrq_notify(thrq, 1);
+    return 0;
+}
+
+/**
+ * @brief   insert element at a priority level and send signal
+ * @param   thrq    queue to be send, see thrq_set_prio()
+ *          data    the data to send
+ *          len     data length
+ *          prio    priority level, 0 ~ levels - 1, higher is received first
+ *
+ * @return  0 is ok, -1 is error with errno (EAGAIN the queue or level is full, EINVAL)
+ **/
+int thrq_send_prio(thrq_cb_t *thrq, void *data, int len, int prio)
+{
+    if (prio < 0 || prio >= thrq->levels) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (prio == 0)
+        return thrq_send(thrq, data, len);
+
+    if (thrq_insert_tail(thrq, data, len, prio) != 0)
+        return -1;
+    thrq_notify(thrq, 1);
+    return 0;
+}
+
+/**
+ * @brief   alloc elements of a batch, from own mpool with one mpool_malloc_n()
+ * @param   thrq    queue
+ *          iov     messages
+ *          n       number of messages
+ *          elms    output elements
+ *
+ * @return  number of elements allocated, the first ones are filled with data
+ **/
+static int thrq_elm_alloc_n(thrq_cb_t *thrq, const struct iovec *iov, int n, thrq_elm_t **elms)
+{
+    int k = 0;
+
+    if (thrq->slab == NULL) {
+        size_t max = 0;
+        for (int i=0; i<n; i++)
+            max = (iov[i].iov_len > max) ? iov[i].iov_len : max;
+        k = mpool_malloc_n(&thrq->mpool, sizeof(thrq_elm_t) + max, (void **)elms, n);
+    } else {
+        while (k < n && (elms[k] = thrq_elm_alloc(thrq, (int)iov[k].iov_len)) != NULL)
+            k++;
+    }
+    for (int i=0; i<k; i++) {
+        memcpy(elms[i]->data, iov[i].iov_base, iov[i].iov_len);
+        elms[i]->len = (int)iov[i].iov_len;
+        elms[i]->prio = 0;
+    }
+    return k;
+}
+
+/**
+ * @brief   append a batch to the list under one lock, signal once
+ * @param   thrq    queue
+ *          iov     messages
+ *          n       number of messages
+ *          flags   THRQ_SEND_ALL or THRQ_SEND_PARTIAL
+ *
+ * @return  number of messages sent, -1 with EAGAIN (full) or ENOMEM
+ *
+ * elements are allocated & filled before taking the queue lock.
+ **/
+static int thrq_list_send_n(thrq_cb_t *thrq, const struct iovec *iov, int n, int flags)
+{
+    thrq_elm_t *stack[32];
+    thrq_elm_t **elms = stack;
+    int k;
+
+    if (n > (int)(sizeof(stack)/sizeof(stack[0]))) {
+        if ((elms = (thrq_elm_t **)malloc(sizeof(thrq_elm_t *) * n)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    int got = thrq_elm_alloc_n(thrq, iov, n, elms);
+    if (got == 0 || (got < n && !(flags & THRQ_SEND_PARTIAL))) {
+        k = 0;
+        errno = ENOMEM;
+    } else if (mux_lock(&thrq->lock) != 0) {
+        k = 0;
+    } else {
+        int room = thrq_list_room(thrq, 0);
+        k = thrq_batch_accept(got, (size_t)((room > 0) ? room : 0), flags);
+        for (int i=0; i<k; i++)
+            thrq_list_link(thrq, elms[i]);
+        __atomic_add_fetch(&thrq->count, k, __ATOMIC_RELAXED);
+        thrq_efd_sync(thrq);
+        mux_unlock(&thrq->lock);
+        if (k == 0)
+            errno = EAGAIN;     /* mux_unlock() clears errno */
+    }
+
+    if (k < got) {
+        const int err = errno;
+        for (int i=k; i<got; i++)
+            thrq_elm_free(thrq, elms[i]);
+        errno = err;
+    }
+    if (elms != stack)
+        free(elms);
+
+    if (k == 0)
+        return -1;
+    thrq_notify(thrq, k);
+    return k;
+}
+
+/**
+ * @brief   send a batch of messages with one lock & one wakeup
+ * @param   thrq    queue to be send
+ *          iov     messages, iov_len > 0
+ *          n       number of messages
+ *          flags   THRQ_SEND_ALL: all or nothing against max_size / ring capacity
+ *                  THRQ_SEND_PARTIAL: send as many as fit, in order
+ *
+ * @return  number of messages sent, -1 is error with errno (EAGAIN is full, ENOMEM)
+ **/
+int thrq_send_n(thrq_cb_t *thrq, const struct iovec *iov, int n, int flags)
+{
+    if (thrq == NULL || iov == NULL || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i=0; i<n; i++) {
+        if (iov[i].iov_base == NULL || iov[i].iov_len == 0 || iov[i].iov_len > INT_MAX ||
+                (thrq->mode != THRQ_MODE_LIST && iov[i].iov_len > thrq->ring->slot_size)) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    switch (thrq->mode) {
+    case THRQ_MODE_SPSC:
+        return thrq_spsc_send_n(thrq, iov, n, flags);
+    case THRQ_MODE_MPMC:
+        return thrq_mpmc_send_n(thrq, iov, n, flags);
+    default:
+        return thrq_list_send_n(thrq, iov, n, flags);
+    }
+}
+
+/**
+ * @brief   send with backpressure, park while the queue is full
+ * @param   thrq        queue to be send
+ *          data        the data to send
+ *          len         data length
+ *          timeout     thread block time, 0 is block until there is room
+ *
+ * @return  0 is ok, -1 is error with errno (ETIMEDOUT, ENOMEM, EINVAL)
+ *
+ *  receivers signal the not-full condition only when a sender is parked.
+ **/
+int thrq_send_timed(thrq_cb_t *thrq, void *data, int len, double timeout)
+{
+    struct timespec ts;
+    const struct timespec *pts = NULL;
+    int res = 0;
+
+    if (thrq == NULL || data == NULL || len <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (timeout > 0) {
+        thrq_deadline(timeout, &ts);
+        pts = &ts;
+    }
+
+    if (thrq->mode != THRQ_MODE_LIST) {
+        while (thrq_send(thrq, data, len) != 0) {
+            if (errno != EAGAIN || thrq_ring_wait_room(thrq, pts) != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    thrq_elm_t *elm = thrq_elm_alloc(thrq, len);
+    if (elm == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(elm->data, data, len);
+    elm->len = len;
+
+    if (mux_lock(&thrq->lock) != 0) {
+        thrq_elm_free(thrq, elm);
+        return -1;
+    }
+    while (res == 0 && thrq_list_room(thrq, 0) <= 0) {
+        __atomic_add_fetch(&thrq->full_waiters, 1, __ATOMIC_RELAXED);
+        if (pts)
+            res = pthread_cond_timedwait(&thrq->cond_notfull, &thrq->lock.mux, pts);
+        else
+            res = pthread_cond_wait(&thrq->cond_notfull, &thrq->lock.mux);
+        __atomic_sub_fetch(&thrq->full_waiters, 1, __ATOMIC_RELAXED);
+    }
+    if (res != 0) {
+        mux_unlock(&thrq->lock);
+        thrq_elm_free(thrq, elm);
+        errno = res;
+        return -1;    // errno may be ETIMEDOUT
+    }
+    thrq_list_link(thrq, elm);
+    __atomic_add_fetch(&thrq->count, 1, __ATOMIC_RELAXED);
+    thrq_efd_sync(thrq);
+    mux_unlock(&thrq->lock);
+
+    thrq_notify(thrq, 1);
+    return 0;
+}
+
+/**
+ * @brief   receive and remove element
+ * @param   thrq        queue to receive
+ *          buf         the data buf
+ *          max_size    buf size
+ *          timeout     thread block time, 0 is block until signal received
  *
  * @return  0 is ok, -VALUE is error.
  * 
@@ -271,24 +1685,20 @@ int thrq_receive(thrq_cb_t *thrq, void *buf, int max_size, double timeout)
     int res = 0;
     struct timespec ts;
 
-    if (timeout > 0) {
-        clock_gettime(CLOCK_MONOTONIC, &ts);
-        ts.tv_nsec = (long)((timeout - (long)timeout) * 1000000000L) + ts.tv_nsec;  // ok, max_long_int = 2.1s > (1s + 1s)
-        ts.tv_sec = (time_t)timeout + ts.tv_sec + (ts.tv_nsec / 1000000000L);
-        ts.tv_nsec = ts.tv_nsec % 1000000000L;
+    if (thrq->mode != THRQ_MODE_LIST) {
+        struct iovec iov = { buf, (max_size > 0) ? (size_t)max_size : 0 };
+        if (thrq_receive_n(thrq, &iov, 1, timeout) < 0)
+            return -1;
+        return (int)iov.iov_len;
     }
+    if (timeout > 0)
+        thrq_deadline(timeout, &ts);
 
     if (mux_lock(&thrq->lock) != 0)
         return -1;
 
     /* break when error occured or data receive */
-    while (res == 0 && thrq->count == 0) {
-        if (timeout > 0) {
-            res = pthread_cond_timedwait(&thrq->cond, &thrq->lock.mux, &ts);
-        } else {
-            res = pthread_cond_wait(&thrq->cond, &thrq->lock.mux);
-        }
-    }
+    res = thrq_list_wait(thrq, (timeout > 0) ? &ts : NULL);
     if (res != 0) {
         const int err = res;
         mux_unlock(&thrq->lock);
@@ -310,7 +1720,417 @@ int thrq_receive(thrq_cb_t *thrq, void *buf, int max_size, double timeout)
     return res;
 }
 
+/**
+ * @brief   receive up to n messages per wakeup
+ * @param   thrq        queue to receive
+ *          iov         n buffers, iov_len of each is set to the bytes copied (truncated to buffer size)
+ *          n           number of buffers
+ *          timeout     thread block time, 0 is block until signal received
+ *
+ * @return  number of messages received (>= 1), -1 is error with errno (ETIMEDOUT)
+ *
+ *  waits once until the queue is not empty, then takes what is queued up to n
+ *  under one lock (list mode) or one head update (SPSC).
+ **/
+int thrq_receive_n(thrq_cb_t *thrq, struct iovec *iov, int n, double timeout)
+{
+    struct timespec ts;
+    const struct timespec *pts = NULL;
+
+    if (thrq == NULL || iov == NULL || n <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (timeout > 0) {
+        thrq_deadline(timeout, &ts);
+        pts = &ts;
+    }
+
+    switch (thrq->mode) {
+    case THRQ_MODE_SPSC:
+        return thrq_spsc_receive_n(thrq, iov, n, pts);
+    case THRQ_MODE_MPMC:
+        return thrq_mpmc_receive_n(thrq, iov, n, pts);
+    default:
+        return thrq_list_receive_n(thrq, iov, n, pts);
+    }
+}
+
+/**
+ * @brief   reserve room for a message to be written in place
+ * @param   thrq    queue to be send
+ *          len     max data length
+ *
+ * @return  writable buffer of len bytes, pass it to thrq_commit().
+ *          NULL is returned on error and errno is set (EAGAIN ring is full, ENOMEM, EINVAL)
+ *
+ * list mode allocs the element only, max_size is checked by thrq_commit().
+ * SPSC & MPMC hand out the next ring slot, one reservation at a time per producer (SPSC).
+ **/
+void* thrq_reserve(thrq_cb_t *thrq, int len)
+{
+    if (thrq == NULL || len <= 0 || (thrq->mode != THRQ_MODE_LIST && (size_t)len > thrq->ring->slot_size)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (thrq->mode == THRQ_MODE_SPSC) {
+        thrq_ring_t *ring = thrq->ring;
+        size_t limit = thrq_ring_limit(thrq);
+        if (ring->tail - ring->head_cache >= limit) {
+            ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (ring->tail - ring->head_cache >= limit) {
+                errno = EAGAIN;
+                return NULL;
+            }
+        }
+        /* slot is not published yet, len keeps the reserved length until commit */
+        thrq_slot_t *slot = THRQ_SLOT(ring, ring->tail);
+        slot->len = len;
+        return slot->data;
+    }
+    if (thrq->mode == THRQ_MODE_MPMC) {
+        size_t pos;
+        thrq_slot_t *slot = thrq_mpmc_claim(thrq, &pos);
+        if (slot == NULL)
+            return NULL;
+        __atomic_store_n(&slot->len, len, __ATOMIC_RELAXED);
+        return slot->data;
+    }
+
+    thrq_elm_t *elm = thrq_elm_alloc(thrq, len);
+    if (elm == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    elm->len = len;
+    return elm->data;
+}
+
+/**
+ * @brief   send the message written to a thrq_reserve() buffer
+ * @param   thrq    queue to be send
+ *          data    buffer returned by thrq_reserve()
+ *          len     data length, <= the reserved length. 0 discards the reservation
+ *
+ * @return  0 is ok. -1 returned with EAGAIN if list is full, or with EINVAL
+ *          if len is over the reserved length, the reservation stays valid
+ *          then (retry or discard it).
+ **/
+int thrq_commit(thrq_cb_t *thrq, void *data, int len)
+{
+    if (thrq == NULL || data == NULL || len < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (thrq->mode != THRQ_MODE_LIST && len > THRQ_SLOT_OF(data)->len) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (thrq->mode == THRQ_MODE_SPSC) {
+        if (len > 0) {
+            thrq_ring_t *ring = thrq->ring;
+            THRQ_SLOT_OF(data)->len = len;
+            __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+            thrq_notify(thrq, 1);
+        }
+        return 0;
+    }
+    if (thrq->mode == THRQ_MODE_MPMC) {
+        /* the slot is claimed already, a discarded one is published as a hole receivers skip */
+        thrq_slot_t *slot = THRQ_SLOT_OF(data);
+        __atomic_store_n(&slot->len, (len > 0) ? len : -1, __ATOMIC_RELAXED);
+        if (len == 0)
+            __atomic_add_fetch(&thrq->ring->holes, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+        if (len > 0)
+            thrq_notify(thrq, 1);
+        return 0;
+    }
+
+    thrq_elm_t *elm = THRQ_ELM_OF(data);
+    if (len == 0) {
+        thrq_elm_free(thrq, elm);
+        return 0;
+    }
+    if (len > elm->len) {
+        errno = EINVAL;
+        return -1;
+    }
+    /* slab frees by size, move a shrunk message to its own class */
+    thrq_elm_t *fit = elm;
+    if (thrq->slab && len < elm->len &&
+            mpool_slab_class(thrq->slab, sizeof(thrq_elm_t) + len) != mpool_slab_class(thrq->slab, sizeof(thrq_elm_t) + elm->len)) {
+        if ((fit = thrq_elm_alloc(thrq, len)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(fit->data, elm->data, len);
+    }
+
+    if (mux_lock(&thrq->lock) < 0)
+        return -1;
+    if (thrq_list_room(thrq, 0) <= 0) {
+        mux_unlock(&thrq->lock);
+        if (fit != elm) {
+            fit->len = len;
+            thrq_elm_free(thrq, fit);
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    fit->len = len;
+    thrq_list_link(thrq, fit);
+    __atomic_add_fetch(&thrq->count, 1, __ATOMIC_RELAXED);
+    thrq_efd_sync(thrq);
+    mux_unlock(&thrq->lock);
+
+    if (fit != elm)
+        thrq_elm_free(thrq, elm);
+    thrq_notify(thrq, 1);
+    return 0;
+}
+
+/**
+ * @brief   get the oldest message in place, without copying
+ * @param   thrq        queue to receive
+ *          len         output data length
+ *          timeout     thread block time, 0 is block until signal received
+ *
+ * @return  message data, read only, pass it to thrq_release() when done.
+ *          NULL is returned on error and errno is set (ETIMEDOUT)
+ *
+ * the message is taken off the queue, other receivers get the next one.
+ * SPSC & MPMC: the slot is not reused until it's released.
+ **/
+const void* thrq_peek(thrq_cb_t *thrq, int *len, double timeout)
+{
+    struct timespec ts;
+    const struct timespec *pts = NULL;
+    int res = 0;
+
+    if (thrq == NULL) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (timeout > 0) {
+        thrq_deadline(timeout, &ts);
+        pts = &ts;
+    }
+
+    if (thrq->mode == THRQ_MODE_SPSC) {
+        thrq_ring_t *ring = thrq->ring;
+        while (ring->head == ring->tail_cache) {
+            ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+            if (ring->head != ring->tail_cache)
+                break;
+            if (thrq_ring_wait(thrq, pts) != 0)
+                return NULL;
+        }
+        thrq_slot_t *slot = THRQ_SLOT(ring, ring->head);
+        if (len)
+            *len = slot->len;
+        return slot->data;
+    }
+    if (thrq->mode == THRQ_MODE_MPMC) {
+        thrq_slot_t *slot;
+        while ((slot = thrq_mpmc_take(thrq)) == NULL) {
+            if (thrq_ring_wait(thrq, pts) != 0)
+                return NULL;
+        }
+        if (len)
+            *len = slot->len;
+        return slot->data;
+    }
+
+    if (mux_lock(&thrq->lock) != 0)
+        return NULL;
+    res = thrq_list_wait(thrq, pts);
+    if (res != 0) {
+        mux_unlock(&thrq->lock);
+        errno = res;
+        return NULL;    // errno may be ETIMEDOUT
+    }
+    thrq_elm_t *elm = THRQ_FIRST(thrq);
+    thrq_list_unlink(thrq, elm);
+    __atomic_sub_fetch(&thrq->count, 1, __ATOMIC_RELAXED);
+    thrq_efd_sync(thrq);
+    thrq_room_notify(thrq, 1);
+    mux_unlock(&thrq->lock);
+
+    if (len)
+        *len = elm->len;
+    return elm->data;
+}
+
+/**
+ * @brief   give back a message got by thrq_peek()
+ * @param   thrq    queue
+ *          data    pointer returned by thrq_peek()
+ *
+ * @return  void
+ **/
+void thrq_release(thrq_cb_t *thrq, const void *data)
+{
+    if (thrq == NULL || data == NULL)
+        return;
+
+    if (thrq->mode == THRQ_MODE_SPSC) {
+        thrq_ring_t *ring = thrq->ring;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    } else if (thrq->mode == THRQ_MODE_MPMC) {
+        thrq_mpmc_put(thrq->ring, THRQ_SLOT_OF(data));
+    } else {
+        thrq_elm_free(thrq, THRQ_ELM_OF(data));
+        return;
+    }
+    thrq_room_notify(thrq, 1);
+}
+
+/**
+ * @brief   send a reference-counted mpool block without copying its data
+ * @param   thrq    queue to be send
+ *          mpool   mpool the block allocated from
+ *          mem     block's data
+ *
+ * @return  0 is ok
+ *
+ * a reference is taken for the receiver, it's dropped again if send fails.
+ * fan-out example:
+ *      frame = mpool_malloc(pool, len);
+ *      for (i=0; i<n; i++)
+ *          thrq_send_ref(q[i], pool, frame);
+ *      mpool_unref(pool, frame);
+ **/
+int thrq_send_ref(thrq_cb_t *thrq, mpool_t *mpool, void *mem)
+{
+    if (mpool_ref(mpool, mem) != 0)
+        return -1;
+    if (thrq_send(thrq, &mem, sizeof(mem)) != 0) {
+        const int err = errno;
+        mpool_unref(mpool, mem);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief   receive a block sent by thrq_send_ref()
+ * @param   thrq        queue to receive
+ *          timeout     thread block time, 0 is block until signal received
+ *
+ * @return  block's data, call mpool_unref() when done with it.
+ *          NULL is returned on error and errno is set (ETIMEDOUT)
+ **/
+void* thrq_receive_ref(thrq_cb_t *thrq, double timeout)
+{
+    void *mem = NULL;
+    if (thrq_receive(thrq, &mem, sizeof(mem), timeout) != (int)sizeof(mem))
+        return NULL;
+    return mem;
+}
+
+/**
+ * @brief   pick the ready queue reported least recently, lockless
+ * @param   queues  queues to check
+ *          n       number of queues
+ * @return  index of queues, -1 if none has data
+ **/
+static int thrq_select_ready(thrq_cb_t *queues[], int n)
+{
+    int idx = -1;
+    uint64_t oldest = UINT64_MAX;
+
+    for (int i=0; i<n; i++) {
+        uint64_t stamp = __atomic_load_n(&queues[i]->sel_stamp, __ATOMIC_RELAXED);
+        if (stamp < oldest && thrq_has_data(queues[i])) {
+            oldest = stamp;
+            idx = i;
+        }
+    }
+    if (idx >= 0)
+        __atomic_store_n(&queues[idx]->sel_stamp, __atomic_add_fetch(&thrq_sel_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    return idx;
+}
+
+/**
+ * @brief   wait until any of the queues has data
+ * @param   queues      queues to wait on, any mode & wait strategy, no duplicates
+ *          n           number of queues, 1 ~ THRQ_SELECT_MAX
+ *          timeout     thread block time, 0 is block until data arrives
+ *
+ * @return  index of a queue with data, -1 returned with errno (EINVAL, ETIMEDOUT)
+ *
+ * when more than one queue is ready the one reported least recently wins, so
+ * a busy queue can not starve the others. the message is not taken: call
+ * thrq_receive() / thrq_receive_n() on queues[index], it does not block if
+ * this thread is the only consumer of that queue. MPMC slots reserved but
+ * not committed yet, or discarded, do not make a queue ready.
+ **/
+int thrq_select(thrq_cb_t *queues[], int n, double timeout)
+{
+    thrq_sel_t link[THRQ_SELECT_MAX];
+    struct timespec ts, *pts = NULL;
+    uint32_t seq = 0;
+    int idx;
+
+    if (queues == NULL || n < 1 || n > THRQ_SELECT_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i=0; i<n; i++) {
+        if (queues[i] == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if ((idx = thrq_select_ready(queues, n)) >= 0)
+        return idx;
+
+    if (timeout > 0) {
+        thrq_deadline(timeout, &ts);
+        pts = &ts;
+    }
+
+    /* park on every queue, thrq_notify() bumps seq & wakes us */
+    for (int i=0; i<n; i++) {
+        link[i].seq = &seq;
+        mux_lock(&queues[i]->lock);
+        LIST_INSERT_HEAD(&queues[i]->sel, &link[i], entry);
+        __atomic_add_fetch(&queues[i]->nsel, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&queues[i]->waiters, 1, __ATOMIC_SEQ_CST);
+        mux_unlock(&queues[i]->lock);
+    }
+
+    for (;;) {
+        uint32_t cur = __atomic_load_n(&seq, __ATOMIC_ACQUIRE);
+        if ((idx = thrq_select_ready(queues, n)) >= 0)
+            break;
+        if (syscall(SYS_futex, &seq, FUTEX_WAIT_BITSET_PRIVATE, cur, pts, NULL, FUTEX_BITSET_MATCH_ANY) != 0 &&
+                errno == ETIMEDOUT) {
+            idx = thrq_select_ready(queues, n);
+            break;
+        }
+    }
+
+    for (int i=0; i<n; i++) {
+        mux_lock(&queues[i]->lock);
+        LIST_REMOVE(&link[i], entry);
+        __atomic_sub_fetch(&queues[i]->nsel, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&queues[i]->waiters, 1, __ATOMIC_RELAXED);
+        mux_unlock(&queues[i]->lock);
+    }
+
+    if (idx < 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    return idx;
+}
+
 #ifdef __cplusplus
 }
 #endif
-
@@ -10,7 +10,10 @@
 #include <errno.h>
 #include <sys/queue.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
 #include "mpool.h"
+#include "mpool_slab.h"
 #include "mux.h"
 
 #ifdef __cplusplus
@@ -18,6 +21,28 @@ extern "C" {
 #endif
 
 #define THRQ_MAX_SIZE_DEFAULT           10000
+#define THRQ_CACHELINE                  64
+#define THRQ_PRIO_MAX                   32      /* priority levels, one bit each in level_mask */
+
+#define THRQ_SPIN_DEFAULT               1000    /* pause loops before THRQ_WAIT_SPIN parks */
+#define THRQ_SELECT_MAX                 64      /* queues per thrq_select() */
+
+/* thrq_send_n() flags */
+#define THRQ_SEND_ALL                   0x0     /* all or nothing */
+#define THRQ_SEND_PARTIAL               0x1     /* accept the messages that fit */
+
+/* queue storage, see thrq_set_ring() */
+enum {
+    THRQ_MODE_LIST = 0,     /* list of elements alloc from mpool/slab, any number of producers & consumers */
+    THRQ_MODE_SPSC,         /* lock-free ring of fixed size slots, one producer & one consumer */
+    THRQ_MODE_MPMC          /* lock-free bounded ring, any number of producers & consumers */
+};
+
+/* receiver wait strategy, see thrq_set_wait() */
+enum {
+    THRQ_WAIT_COND = 0,     /* sleep on the condition variable, lowest cpu */
+    THRQ_WAIT_SPIN          /* spin with pause, then park on a futex, lowest latency */
+};
 
 /**
  * declare user data type with list head struct: 
@@ -39,6 +64,7 @@ extern "C" {
 typedef struct __thrq_elm {
     TAILQ_ENTRY(__thrq_elm) entry;
     int                     len;
+    int                     prio;       /* priority level */
     unsigned char           data[];     /* flexible array */
 } thrq_elm_t;
 
@@ -52,17 +78,77 @@ typedef struct __thrq_elm {
  **/
 typedef TAILQ_HEAD(__thrq_head, __thrq_elm) thrq_head_t;
 
+/* one priority level, see thrq_set_prio() */
+typedef struct {
+    thrq_head_t             head;
+    int                     count;
+    int                     max_size;
+} thrq_level_t;
+
+/* ring slot, data is copied in place */
+typedef struct {
+    size_t                  seq;            /* MPMC: slot is writable at seq == pos, readable at seq == pos + 1 */
+    int                     len;
+    unsigned char           data[];
+} thrq_slot_t;
+
+/**
+ * ring of capacity (power of 2) slots, slots follow the struct in the same allocation.
+ * producer & consumer fields are on their own cache lines, each side keeps
+ * a cached copy of the other's index to touch the shared line only when needed.
+ **/
+typedef struct {
+    size_t                  tail;           /* next slot to write, producer owned (MPMC: shared by producers) */
+    size_t                  head_cache;     /* producer's copy of head, SPSC */
+    char                    pad0[THRQ_CACHELINE - 2*sizeof(size_t)];
+    size_t                  head;           /* next slot to read, consumer owned (MPMC: shared by consumers) */
+    size_t                  tail_cache;     /* consumer's copy of tail, SPSC */
+    size_t                  holes;          /* MPMC: discarded slots between head & tail */
+    char                    pad1[THRQ_CACHELINE - 3*sizeof(size_t)];
+    size_t                  mask;           /* capacity - 1 */
+    size_t                  slot_size;      /* max user data per slot */
+    size_t                  stride;         /* bytes per slot */
+    char                    pad2[THRQ_CACHELINE - 3*sizeof(size_t)];
+    unsigned char           slots[];
+} thrq_ring_t;
+
+/* thrq_select() waiter link, one per queue on the caller's stack */
+typedef struct __thrq_sel thrq_sel_t;
+typedef LIST_HEAD(__thrq_sel_head, __thrq_sel) thrq_sel_head_t;
+
 /* thread safe queue control block */
 typedef struct {
     mpool_t             mpool;
-    
+    mpool_slab_t*       slab;           /* elements alloc from slab if not NULL */
+
     thrq_head_t         head;           /* list header */
     mux_t               lock;           /* data lock */
     pthread_condattr_t  cond_attr;
     pthread_cond_t      cond;
+    pthread_cond_t      cond_notfull;   /* senders wait for room, see thrq_send_timed() */
 
-    int                 count;
+    int                 count;          /* atomic under lock, THRQ_WAIT_SPIN reads it lockless */
     int                 max_size;
+
+    int                 mode;
+    thrq_ring_t*        ring;           /* slots of ring modes */
+    int                 waiters;        /* receivers parked on cond or futex */
+    int                 full_waiters;   /* senders parked on cond_notfull */
+
+    int                 levels;         /* priority levels, 1 is plain FIFO on head */
+    unsigned int        level_mask;     /* bit n is set if level n is not empty */
+    thrq_level_t*       level;          /* levels > 1: one list per level */
+
+    int                 efd;            /* eventfd readable while not empty, -1 if disabled */
+    int                 efd_ready;      /* efd is signalled */
+
+    int                 wait_mode;      /* THRQ_WAIT_COND or THRQ_WAIT_SPIN */
+    int                 spin;           /* pause loops before parking, THRQ_WAIT_SPIN */
+    uint32_t            futex;          /* wake sequence, THRQ_WAIT_SPIN */
+
+    thrq_sel_head_t     sel;            /* thrq_select() callers parked on this queue */
+    int                 nsel;
+    uint64_t            sel_stamp;      /* last time thrq_select() reported this queue */
 } thrq_cb_t;
 
 extern int          thrq_init           (thrq_cb_t *thrq);
@@ -71,12 +157,34 @@ extern void         thrq_destroy        (thrq_cb_t *thrq);
 
 extern int          thrq_set_maxsize    (thrq_cb_t *thrq, int max_size);
 extern int          thrq_set_mpool      (thrq_cb_t *thrq, size_t n, size_t data_size);
+extern int          thrq_set_slab       (thrq_cb_t *thrq, mpool_slab_t *slab);
+extern int          thrq_set_ring       (thrq_cb_t *thrq, int mode, size_t capacity, size_t slot_size);
+extern int          thrq_set_prio       (thrq_cb_t *thrq, int levels);
+extern int          thrq_set_level_maxsize(thrq_cb_t *thrq, int level, int max_size);
+extern int          thrq_set_eventfd    (thrq_cb_t *thrq, int enable);
+extern int          thrq_fd             (thrq_cb_t *thrq);
+extern int          thrq_set_wait       (thrq_cb_t *thrq, int mode, int spin);
 
 extern int          thrq_empty          (thrq_cb_t *thrq);
 extern int          thrq_count          (thrq_cb_t *thrq);
+extern int          thrq_level_count    (thrq_cb_t *thrq, int level);
 
 extern int          thrq_send           (thrq_cb_t *thrq, void *data, int len);
+extern int          thrq_send_prio      (thrq_cb_t *thrq, void *data, int len, int prio);
+extern int          thrq_send_timed     (thrq_cb_t *thrq, void *data, int len, double timeout);
+extern int          thrq_send_n         (thrq_cb_t *thrq, const struct iovec *iov, int n, int flags);
 extern int          thrq_receive        (thrq_cb_t *thrq, void *buf, int max_size, double timeout);
+extern int          thrq_receive_n      (thrq_cb_t *thrq, struct iovec *iov, int n, double timeout);
+
+extern void*        thrq_reserve        (thrq_cb_t *thrq, int len);
+extern int          thrq_commit         (thrq_cb_t *thrq, void *data, int len);
+extern const void*  thrq_peek           (thrq_cb_t *thrq, int *len, double timeout);
+extern void         thrq_release        (thrq_cb_t *thrq, const void *data);
+
+extern int          thrq_send_ref       (thrq_cb_t *thrq, mpool_t *mpool, void *mem);
+extern void*        thrq_receive_ref    (thrq_cb_t *thrq, double timeout);
+
+extern int          thrq_select         (thrq_cb_t *queues[], int n, double timeout);
 
 #ifdef __cplusplus
 }